@@ -34,6 +34,19 @@ print()
 print('LUAOT:=$(LUASRC)/luaot')
 print('INCLUDES:=$(LUASRC)/luaot-generated-header.c $(LUASRC)/luaot-generated-footer.c')
 print()
+
+# The libraries are cached under the key from `luaot --cache-key` (a hash of
+# the bytecode, the luaot options and luaot itself) plus a checksum of the C
+# compiler flags, so a module is only compiled again when its bytecode changed.
+print('LUAOT_CACHE?=$(or $(XDG_CACHE_HOME),$(HOME)/.cache)/luaot')
+print()
+print('define CACHED_SO')
+print('key=$$($(LUAOT) --cache-key $(1) -o $(2))-$$(echo \'$(CC) $(CFLAGS)\' | cksum | cut -d\' \' -f1) && \\')
+print('if [ -f "$(LUAOT_CACHE)/$$key.so" ]; then cp "$(LUAOT_CACHE)/$$key.so" $(3); else \\')
+print('  $(CC) $(CFLAGS) -shared $(2) -o $(3) && mkdir -p "$(LUAOT_CACHE)" && \\')
+print('  cp $(3) "$(LUAOT_CACHE)/$$key.so.$$$$" && mv "$(LUAOT_CACHE)/$$key.so.$$$$" "$(LUAOT_CACHE)/$$key.so"; fi')
+print('endef')
+print()
 print(".PHONY: all clean")
 print()
 
@@ -49,7 +62,7 @@ for lua_file, c_file in zip(lua_files, c_files):
     print('\t' + '$(LUAOT)' + ' ' + lua_file + ' -o ' + c_file)
     print( )
 
-for c_file, so_file in zip(c_files, so_files):
+for lua_file, c_file, so_file in zip(lua_files, c_files, so_files):
     print(so_file + ':' + ' ' + c_file + ' ' + '$(INCLUDES)' )
-    print('\t' + '$(CC) $(CFLAGS) -shared ' + ' ' + c_file + ' -o ' + so_file)
+    print('\t' + '$(call CACHED_SO,' + lua_file + ',' + c_file + ',' + so_file + ')')
     print( )
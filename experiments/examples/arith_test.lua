@@ -0,0 +1,56 @@
+
+-- Arithmetic that the type inference specializes. The operands are locals
+-- whose types luaot can infer, so that we get the integer-only and float-only
+-- code, and the results must be the same as in the interpreter.
+
+local function check(f, ...)
+    local ok, err = pcall(f, ...)
+    if ok then return end
+    print("error:", (string.gsub(err, "^.-:%d+: ", "")))
+end
+
+local mi = -9223372036854775807 - 1
+local mx = 9223372036854775807
+local m1 = -1
+local zero = 0
+local fzero = 0.0
+
+-- mininteger and -1
+print(mi // m1, mi % m1, mi * m1, m1 * mi, mi - m1, mx - m1)
+print(mi // -1, mi % -1)
+for i = -1, 1, 2 do
+    print(mi // i, mi % i, mx // i, mx % i)
+end
+
+-- Integer division and modulo by zero
+check(function() return mi // zero end)
+check(function() return 7 % zero end)
+for i = 0, 0 do
+    check(function() return 5 // i end)
+    check(function() return 5 % i end)
+end
+
+-- Division by 0.0
+print(1 // fzero, -1 // fzero, 1 / zero, -1 / zero, mi / zero)
+print(7 // 0.0, -7 // 0.0, 7.5 % fzero ~= 7.5 % fzero)
+for i = 1, 2 do
+    print(i // fzero, -i // fzero, i / fzero, i % math.huge, -i % math.huge)
+end
+
+-- Mixed integers and floats
+local a, b = 7, 2.0
+print(a // b, a % b, a / 2, a ^ 2, -a // 2, -a % 2, a // -2, a % -2)
+print(3 % -2.5, -3 % 2.5, 5.5 // 2, -5.5 // 2)
+
+-- Strings are converted to numbers in arithmetic (but not in bitwise ops
+-- on non-integral values)
+local s, t, h = "10", "2.5", "0x10"
+print(s + 1, s * 2, s // 3, s % 3, s / 4, s ^ 2, -s)
+print(t + 1, t * t, h + 0, h // 1, "1e1" // 1, " 7 " - 1)
+print(s | 1, s & 3, h >> 1, ~s)
+for i = 1, 3 do
+    print(i + s, i * t, s - i, h % i)
+end
+check(function() return s + "abc" end)
+check(function() return t | 1 end)
+check(function() return s + {} end)
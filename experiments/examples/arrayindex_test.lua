@@ -0,0 +1,63 @@
+
+-- Integer keys take a fast path through the array part of a table. Keys that
+-- are outside of the array part, absent values and metamethods take the slow
+-- path, and the results must be the same as in the interpreter.
+
+local function get(t, k) return t[k] end
+local function set(t, k, v) t[k] = v end
+local function show(t, n)
+    local parts = {}
+    for i = -1, n do parts[#parts + 1] = tostring(get(t, i)) end
+    print(table.concat(parts, " "))
+end
+
+-- Inside and outside of the array part, and keys that are not integers
+local t = {10, 20, 30}
+show(t, 5)
+set(t, 4, 40)
+set(t, 0, 0)
+set(t, -1, -10)
+set(t, 2, nil)
+show(t, 5)
+print(get(t, 1.0), get(t, 1.5), get(t, "1"), get(t, 2^53))
+set(t, 3.0, "three")
+print(get(t, 3), #t >= 1)
+
+-- A table that only has a hash part, and one that grows its array part
+local h = {}
+for i = 10, 1, -1 do set(h, i, i * i) end
+show(h, 11)
+local g = {}
+for i = 1, 100 do set(g, i, i) end
+print(get(g, 1), get(g, 64), get(g, 100), get(g, 101))
+
+-- Metamethods only run for absent keys
+local log = {}
+local m = setmetatable({1, nil, 3}, {
+    __index = function(_, k) return "index " .. tostring(k) end,
+    __newindex = function(t, k, v) log[#log + 1] = k; rawset(t, k, v) end,
+})
+show(m, 4)
+set(m, 1, "one")
+set(m, 2, "two")
+set(m, 5, "five")
+show(m, 5)
+print(table.concat(log, " "))
+
+-- __index with a table, and a proxy
+local base = {"a", "b", "c"}
+local proxy = setmetatable({}, {__index = base})
+show(proxy, 4)
+set(proxy, 2, "B")
+show(proxy, 4)
+
+-- Strings and values that cannot be indexed
+local function check(f, ...)
+    local ok, err = pcall(f, ...)
+    if not ok then print("error:", (string.gsub(err, "^.-:%d+: ", ""))) end
+end
+print(get("abc", 1))
+check(get, 5, 1)
+check(set, nil, 1, 1)
+check(set, {}, 0/0, 1)
+check(set, {}, nil, 1)
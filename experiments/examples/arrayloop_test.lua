@@ -0,0 +1,117 @@
+-- This is meant to test the numeric for loops where luaot checks the tables
+-- once, in the FORPREP, instead of in every access (see PrintLoopGuard)
+
+local function range(n)
+    local a = {}
+    for i = 1, n do a[i] = i end
+    return a
+end
+
+local function sum(a, first, last, step)
+    local s = 0
+    for i = first, last, step do
+        s = s + (a[i] or 0)
+    end
+    return s
+end
+
+local function sumwhile(a, first, last)
+    local s = 0
+    for i = first, last do
+        local v = a[i]
+        if v == nil then break end
+        s = s + v
+    end
+    return s
+end
+
+local a = range(10)
+print("sum 1..10           =", sum(a, 1, #a, 1))
+print("sum 10..1           =", sum(a, #a, 1, -1))
+print("sum 1..20           =", sum(a, 1, 20, 1))
+print("sum 0..10           =", sum(a, 0, #a, 1))
+print("sum 1..10 by 3      =", sum(a, 1, #a, 3))
+print("sum 1..0            =", sum(a, 1, 0, 1))
+print()
+
+-- The index must not wrap around (in Lua 5.3 it does, so these loops must
+-- stop before it runs in circles)
+print("step maxinteger     =", sum(a, 1, #a, math.maxinteger))
+print("step maxinteger - 1 =", sum(a, 2, #a, math.maxinteger - 1))
+print("step mininteger     =", sum(a, #a, 1, math.mininteger))
+print("near maxinteger     =", sum(a, math.maxinteger - 2, math.maxinteger - 1, 1))
+print("near mininteger     =", sum(a, math.mininteger + 2, math.mininteger + 1, -1))
+print("up to maxinteger    =", sumwhile(a, 1, math.maxinteger))
+print()
+
+-- Float and string bounds
+print("float limit 3.5     =", sum(a, 1, 3.5, 1))
+print("float limit -0.5    =", sum(a, 1, -0.5, 1))
+print("float limit 1e100   =", sumwhile(a, 1, 1e100))
+print("huge limit          =", sumwhile(a, 8, math.huge))
+print("float init          =", sum(a, 1.0, #a, 1))
+print("float step          =", sum(a, 1, #a, 2.0))
+print("string limit        =", sum(a, 1, "4", 1))
+print("string init         =", sum(a, "7", #a, 1))
+print("string step         =", sum(a, 1, #a, "5"))
+print()
+
+-- Metamethods that change the table while the loop runs
+local function addall(a, o)
+    local s = 0
+    for i = 1, #a do
+        s = s + a[i]
+        s = s + (o + i)
+    end
+    return s
+end
+
+local function setall(a, o)
+    for i = 1, #a do
+        a[i] = (a[i] or 1) * 2
+        o.x = i
+    end
+    return a
+end
+
+local b = range(10)
+local grows = setmetatable({}, { __add = function(_, i)
+    if i == 3 then
+        for k = #b + 1, 100 do b[k] = k end  -- reallocates the array part
+    end
+    return 0
+end })
+print("grows               =", addall(b, grows), #b)
+
+local c = range(10)
+local gets_mt = setmetatable({}, { __add = function(_, i)
+    if i == 5 then
+        c[i+1] = nil
+        setmetatable(c, { __index = function(_, k) return 1000 * k end })
+    end
+    return 0
+end })
+print("gets a metatable    =", addall(c, gets_mt))
+
+local d = range(10)
+local shrinks = setmetatable({}, { __add = function(_, i)
+    if i == 2 then
+        for k = 3, 10 do d[k] = nil end
+        for k = 1, 100 do d["x" .. k] = k end  -- rehash, shrinks the array part
+        for k = 3, 10 do d[k] = -k end
+    end
+    return 0
+end })
+print("shrinks             =", addall(d, shrinks))
+
+local e = range(10)
+local log = {}
+local newindex = setmetatable({}, { __newindex = function(_, k, v)
+    log[#log + 1] = v
+    if v == 4 then
+        setmetatable(e, { __newindex = function(t, k, v) rawset(t, k, -v) end })
+        for k = 5, 10 do e[k] = nil end
+    end
+end })
+setall(e, newindex)
+print("newindex            =", table.concat(e, " "), #log)
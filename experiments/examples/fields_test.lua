@@ -0,0 +1,55 @@
+
+-- Accesses to constant field names (obj.field) remember where the field was
+-- in the last table. The same site sees tables with different layouts here,
+-- and the results must be the same as in the interpreter.
+
+local function getx(t) return t.x end
+local function setx(t, v) t.x = v end
+
+local shapes = {
+    {x = 1},
+    {x = 2, y = 3},
+    {y = 4, x = 5},
+    {a = 1, b = 2, c = 3, d = 4, x = 6},
+    {7, 8, 9, x = 10},
+    {},
+    {y = 11},
+}
+for round = 1, 2 do
+    local out = {}
+    for i, t in ipairs(shapes) do out[i] = tostring(getx(t)) end
+    print(table.concat(out, " "))
+    for i, t in ipairs(shapes) do setx(t, (getx(t) or 0) + 100) end
+end
+
+-- The field is removed, added again, and the table rehashes in between
+local t = {x = 1, y = 2}
+print(getx(t))
+setx(t, nil)
+print(getx(t))
+for i = 1, 100 do t["k" .. i] = i end
+setx(t, 3)
+print(getx(t))
+for i = 1, 100 do t["k" .. i] = nil end
+collectgarbage()
+print(getx(t), t.y)
+
+-- Two tables with the same layout
+local p, q = {x = "p"}, {x = "q"}
+for i = 1, 2 do print(getx(p), getx(q)) end
+
+-- Metamethods run only for absent fields
+local defaults = setmetatable({}, {__index = function(_, k) return "default " .. k end})
+print(getx(defaults))
+setx(defaults, "own")
+print(getx(defaults))
+local logged = setmetatable({}, {__newindex = function(t, k, v) rawset(t, k, v * 2) end})
+setx(logged, 21)
+setx(logged, 5)
+print(getx(logged))
+
+-- Values that are not tables
+local ok, err = pcall(getx, 42)
+print(getx("a string"), ok, (string.gsub(err, "^.-:%d+: ", "")))
+local proxy = setmetatable({}, {__index = {x = "from __index table"}})
+print(getx(proxy))
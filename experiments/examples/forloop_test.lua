@@ -0,0 +1,76 @@
+
+-- Numeric for loops with integer and float control variables. luaot compiles
+-- separate integer and float versions of the loop body, and the output must
+-- be the same as in the interpreter.
+
+local function check(f, ...)
+    local ok, err = pcall(f, ...)
+    if not ok then print("error:", (string.gsub(err, "^.-:%d+: ", ""))) end
+end
+
+local function run(first, limit, step)
+    local n, sum, last = 0, 0, nil
+    for i = first, limit, step do
+        n = n + 1
+        sum = sum + i * 2
+        last = i
+        if n > 10 then break end
+    end
+    print(first, limit, step, n, sum, last, math.type(last))
+end
+
+-- Integer and float loops, and loops where only some of the values are floats
+run(1, 3, 1)
+run(1, 3.5, 1)
+run(1.0, 3, 1)
+run(1, 3, 1.0)
+run(1, 2, 0.5)
+run(0.25, 1, 0.25)
+run(3, 1, -1)
+run(3, 1.5, -1)
+run(3.5, 1, -1)
+run(1, 0, 1)
+run(0.1, 0.3, 0.1)
+
+-- The same loop with integer and float bounds, inlined
+local isum, fsum = 0, 0
+for i = 1, 4 do isum = isum + i end
+for i = 1.0, 4 do fsum = fsum + i end
+print(isum, fsum, math.type(isum), math.type(fsum))
+for i = 1, 3 do
+    for j = i, 2.5 do
+        io.write(i, ":", j, " ")
+    end
+end
+print()
+
+-- Near the limits of the integers
+local mx, mi = math.maxinteger, math.mininteger
+run(mx - 2, mx, 1)
+run(mx - 1, mx, 2)
+run(mi + 2, mi, -1)
+run(mi, mi + 1, -2)
+run(mx, mx + 0.0, 1)
+run(mi, -1e100, -1)
+run(1, 1e100, mx)
+run(1, math.huge, 2 ^ 62)
+run(-1, -math.huge, -(2 ^ 62))
+
+-- Limits that are strings or not numbers
+run(1, "3", 1)
+run("1", 3, 1)
+run(1, 3, "1")
+check(run, 1, "x", 1)
+check(run, 1, nil, 1)
+check(run, {}, 3, 1)
+check(run, 1, 3, false)
+run(1, 3, 0)
+run(1, 3, 0.0 / 1 + 0.5)
+
+-- Changing the control variable does not change the loop
+for i = 1, 3 do
+    local j = i
+    i = i * 10
+    io.write(j, "->", i, " ")
+end
+print()
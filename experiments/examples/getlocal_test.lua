@@ -0,0 +1,78 @@
+
+-- Registers that live in C locals in the compiled code must still show their
+-- values to debug.getlocal
+
+local function dump(level)
+    local vars = {}
+    for i = 1, math.huge do
+        local name, value = debug.getlocal(level + 1, i)
+        if not name then break end
+        if string.sub(name, 1, 1) ~= "(" then
+            vars[#vars + 1] = name .. "=" .. tostring(value)
+        end
+    end
+    print(table.concat(vars, " "))
+end
+
+local function sums(n)
+    local isum, fsum = 0, 0.5
+    for i = 1, n do
+        isum = isum + i
+        fsum = fsum * 2
+        dump(1)
+    end
+    -- isum and fsum are not read after the loop, but they are still in scope
+    dump(1)
+end
+sums(3)
+
+local function dead()
+    local x = 1
+    x = x + 41
+    dump(1)
+end
+dead()
+
+-- From a hook
+local function hooked(n)
+    local acc = 0
+    for i = 1, n do
+        acc = acc + i * 2
+    end
+    return acc
+end
+local lines = 0
+debug.sethook(function()
+    local name, value = debug.getlocal(2, 2)
+    if name == "acc" and lines < 6 then
+        lines = lines + 1
+        print("hook", name, value)
+    end
+end, "l")
+hooked(3)
+debug.sethook()
+
+-- debug.setlocal on a register that lives in a C local
+local function setter()
+    local n = 10
+    for i = 1, 2 do
+        n = n + 1
+        debug.setlocal(1, 1, 100)  -- (n is local 1)
+        n = n + 1
+        print("setlocal", n)
+    end
+end
+setter()
+
+-- ...and from a hook
+local function hooked_setter()
+    local x = 0
+    for i = 1, 3 do x = x + i end
+    return x
+end
+debug.sethook(function()
+    local name, value = debug.getlocal(2, 1)
+    if name == "x" and value == 3 then debug.setlocal(2, 1, 100) end
+end, "l")
+print("hook setlocal", hooked_setter())
+debug.sethook()
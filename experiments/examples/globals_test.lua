@@ -0,0 +1,60 @@
+
+-- Global variable accesses go through a cache of the node of each name in
+-- _ENV. The cache must notice when the global is removed and set again,
+-- when the table of globals grows, and when it gets a metatable.
+
+local function get_counter() return counter end
+local function set_counter(v) counter = v end
+
+counter = 1
+print(get_counter())
+set_counter(nil)
+print(get_counter())
+set_counter(3)
+print(get_counter())
+for i = 1, 3 do
+    set_counter(i % 2 == 0 and i or nil)
+    print(i, get_counter())
+end
+
+-- Many new globals make the table rehash, which moves the nodes
+for i = 1, 1000 do
+    _G["global_" .. i] = i
+end
+set_counter(4)
+print(get_counter(), rawget(_G, "counter"), global_500)
+for i = 1, 1000 do
+    _G["global_" .. i] = nil
+end
+collectgarbage()
+print(get_counter(), global_500)
+
+-- __index and __newindex only apply to absent globals
+local function get_missing() return missing end
+local function set_missing(v) missing = v end
+print(get_missing())
+setmetatable(_G, {
+    __index = function(t, k) return "default " .. k end,
+    __newindex = function(t, k, v) rawset(t, k, v and v * 10) end,
+})
+print(get_missing(), get_counter())
+set_missing(5)
+print(get_missing(), rawget(_G, "missing"))
+set_missing(nil)
+print(get_missing())
+set_counter(nil)
+print(get_counter())
+set_counter(6)
+print(get_counter())
+setmetatable(_G, nil)
+set_missing(nil)
+print(get_missing(), get_counter())
+
+-- A function with another _ENV
+local function with_env(env)
+    local _ENV = env
+    x = (x or 0) + 1
+    return x
+end
+local env = {}
+print(with_env(env), with_env(env), with_env({x = 10}), rawget(_G, "x"))
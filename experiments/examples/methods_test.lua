@@ -0,0 +1,69 @@
+
+-- Method calls (obj:method()) remember the method that they found through the
+-- __index chain. Methods are rebound and shadowed here, and the results must
+-- be the same as in the interpreter.
+
+local Animal = {}
+Animal.__index = Animal
+function Animal.new(name) return setmetatable({name = name}, Animal) end
+function Animal:speak() return self.name .. " makes a sound" end
+
+local Dog = setmetatable({}, {__index = Animal})
+Dog.__index = Dog
+function Dog.new(name) return setmetatable({name = name}, Dog) end
+
+local function speak(obj) return obj:speak() end
+
+local a, d = Animal.new("cat"), Dog.new("rex")
+print(speak(a), speak(d))
+
+-- Rebinding the method in the class, and in the base class
+function Animal:speak() return self.name .. " purrs" end
+print(speak(a), speak(d))
+function Dog:speak() return self.name .. " barks" end
+print(speak(a), speak(d))
+Dog.speak = nil
+print(speak(a), speak(d))
+
+-- Shadowing the method in the instance, and removing the shadow
+d.speak = function(self) return self.name .. " howls" end
+print(speak(a), speak(d))
+d.speak = nil
+print(speak(a), speak(d))
+
+-- Changing the metatable, and __index functions
+setmetatable(d, {__index = function(_, k)
+    return function(self) return self.name .. " says " .. k end
+end})
+print(speak(d))
+setmetatable(d, Animal)
+print(speak(d))
+Animal.__index = {speak = function(self) return "replaced __index" end}
+print(speak(a), speak(d))
+Animal.__index = Animal
+
+-- Many objects of the same class, in a loop
+local objs = {}
+for i = 1, 5 do objs[i] = Animal.new("a" .. i) end
+for i = 1, 5 do
+    if i == 3 then objs[i].speak = function() return "shadowed" end end
+    if i == 4 then function Animal:speak() return self.name .. " rebound" end end
+    io.write(speak(objs[i]), "; ")
+end
+print()
+
+-- String methods, and the string metatable
+local function upper(s) return s:upper() end
+local function rep(s, n) return s:rep(n, ",") end
+print(upper("abc"), rep("x", 3))
+local old_upper = string.upper
+string.upper = function(s) return "<" .. old_upper(s) .. ">" end
+print(upper("abc"))
+string.upper = old_upper
+print(upper("abc"))
+
+-- Missing methods and values without methods
+local ok, err = pcall(function() return a:missing() end)
+print(ok, (string.gsub(err, "^.-:%d+: ", "")))
+ok, err = pcall(speak, 42)
+print(ok, (string.gsub(err, "^.-:%d+: ", "")))
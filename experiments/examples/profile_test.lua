@@ -0,0 +1,15 @@
+
+-- Functions that start on the same line and have the same size. luaot
+-- --profile must credit each one with its own calls (only sub runs here).
+local ops = {add = function(a, b) return a + b end, sub = function(a, b) return a - b end}
+
+local s = 0
+for i = 1, 100 do
+    s = ops.sub(s, i)
+end
+print(s)
+
+-- The same code on the same line: the records cannot be told apart, so
+-- both functions must be compiled
+local one, other = function() return 1 end, function() return 1 end
+print(one() + other())
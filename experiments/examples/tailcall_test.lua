@@ -0,0 +1,78 @@
+
+-- Deep tail recursion must run in constant stack space
+
+local function count(n, acc)
+    if n == 0 then return acc end
+    return count(n - 1, acc + 1)
+end
+print(count(3e6, 0))
+
+local is_even, is_odd
+function is_even(n)
+    if n == 0 then return true end
+    return is_odd(n - 1)
+end
+function is_odd(n)
+    if n == 0 then return false end
+    return is_even(n - 1)
+end
+print(is_even(3e6), is_odd(3e6 + 1))
+
+-- Fewer and more arguments than parameters, and a vararg callee
+
+local function three(a, b, c)
+    return a, b, c
+end
+local function fewer(x) return three(x) end
+local function more(x) return three(x, x + 1, x + 2, x + 3, x + 4) end
+print(fewer(1))
+print(more(10))
+
+local function vararg(...)
+    return select('#', ...), ...
+end
+local function to_vararg(a, b) return vararg(a, b, nil) end
+local function to_vararg_multi(...) return vararg(...) end
+print(to_vararg(1, 2))
+print(to_vararg_multi(1, nil, 3, nil))
+
+local function vararg_loop(n, ...)
+    if n == 0 then return select('#', ...) end
+    return vararg_loop(n - 1, ...)
+end
+print(vararg_loop(1e5, 'a', 'b'))
+
+-- Yields across tail-called functions
+
+local function yielder(n)
+    local got = coroutine.yield(n)
+    return got * 2
+end
+local function chain(n)
+    if n == 0 then return yielder(100) end
+    return chain(n - 1)
+end
+local co = coroutine.wrap(function(n)
+    local r = chain(n)
+    coroutine.yield(r)
+    return 'done'
+end)
+print(co(1000))
+print(co(21))
+print(co())
+
+-- Tail calls to C functions
+
+local function c_select(...) return select(2, ...) end
+local function c_max(a, b, c) return math.max(a, b, c) end
+local function c_error(msg) return error(msg, 0) end
+local function c_pcall(f, ...) return pcall(f, ...) end
+local function c_yield(x) return coroutine.yield(x) end
+print(c_select('a', 'b', 'c'))
+print(c_max(3, 9, 4))
+print(pcall(c_error, 'oops'))
+print(c_pcall(c_error, 'caught'))
+print(c_pcall(count, 10, 0))
+local co2 = coroutine.wrap(function(x) return c_yield(x + 1) end)
+print(co2(1))
+print(co2('resumed'))
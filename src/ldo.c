@@ -28,6 +28,7 @@
 #include "lstate.h"
 #include "lstring.h"
 #include "ltable.h"
+#include "ltier.h"
 #include "ltm.h"
 #include "lundump.h"
 #include "lvm.h"
@@ -440,8 +441,17 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
     case LUA_TLCL: {  /* Lua function: prepare its call */
       StkId base;
       Proto *p = clLvalue(func)->p;
-      int n = cast_int(L->top - func) - 1;  /* number of real arguments */
-      int fsize = p->maxstacksize;  /* frame size */
+      int n;
+      int fsize;
+#if defined(LUAOT_TIER)
+      if (G(L)->aottier) {  /* tiered AOT compilation? */
+        ptrdiff_t funcr = savestack(L, func);
+        luaJ_call(L, p);  /* (may install compiled code and move the stack) */
+        func = restorestack(L, funcr);
+      }
+#endif
+      n = cast_int(L->top - func) - 1;  /* number of real arguments */
+      fsize = p->maxstacksize;  /* frame size */
       checkstackp(L, fsize, func);
       if (p->is_vararg)
         base = adjust_varargs(L, p, n);
@@ -458,12 +468,16 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
       lua_assert(ci->top <= L->stack_last);
       ci->u.l.savedpc = p->code;  /* starting point */
       ci->callstatus = CIST_LUA;
+#if defined(LUAOT_PROFILE)
+      if (G(L)->aotprofile)  /* profiling for luaot? */
+        luaF_profilecall(L, p);
+#endif
       if (L->hookmask & LUA_MASKCALL)
         callhook(L, ci);
 
       /* AOT compilation magic */
       if (p->magic_implementation) {
-        p->magic_implementation(L, clLvalue(func));
+        luaD_runmagic(L, ci);
         return 1;
       }
 
@@ -479,6 +493,47 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
 }
 
 
+/*
+** Runs the magic implementation of the Lua function in 'ci'. To do a proper
+** tail call to another magic function, a magic function moves the callee
+** and its arguments down to 'ci->func' and returns ZZ_MAGIC_TAILCALL. The
+** CallInfo is then reused for the callee, without growing the C stack. The
+** callee is known to be a function with a magic implementation.
+*/
+void luaD_runmagic (lua_State *L, CallInfo *ci) {
+  LClosure *cl = clLvalue(ci->func);
+  while (cl->p->magic_implementation(L, cl) == ZZ_MAGIC_TAILCALL) {
+    luaD_magictailcall(L, ci);
+    cl = clLvalue(ci->func);
+  }
+}
+
+
+/*
+** Prepares 'ci' to run the function that a magic function moved down to
+** 'ci->func' before returning ZZ_MAGIC_TAILCALL, like 'luaD_precall' does
+** for a new CallInfo.
+*/
+void luaD_magictailcall (lua_State *L, CallInfo *ci) {
+  Proto *p = clLvalue(ci->func)->p;
+  int n;
+  lua_assert(L->ci == ci);
+  lua_assert(p->magic_implementation);
+  luaD_checkstack(L, p->maxstacksize);  /* may change 'ci->func' */
+  n = cast_int(L->top - ci->func) - 1;  /* number of real arguments */
+  if (p->is_vararg)
+    ci->u.l.base = adjust_varargs(L, p, n);
+  else {  /* non vararg function */
+    for (; n < p->numparams; n++)
+      setnilvalue(L->top++);  /* complete missing arguments */
+    ci->u.l.base = ci->func + 1;
+  }
+  L->top = ci->top = ci->u.l.base + p->maxstacksize;
+  ci->u.l.savedpc = p->code;
+  ci->callstatus |= CIST_TAIL;
+}
+
+
 /*
 ** Check appropriate error for stack overflow ("regular" overflow or
 ** overflow while handling stack overflow). If 'nCalls' is larger than
@@ -11,6 +11,9 @@
 
 
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "lua.h"
 
@@ -18,6 +21,7 @@
 #include "lgc.h"
 #include "lmem.h"
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 
 
@@ -96,6 +100,205 @@ void luaF_close (lua_State *L, StkId level) {
 }
 
 
+/*
+** {======================================================
+** Run-time profiles for profile-guided AOT compilation
+** =======================================================
+**
+** A VM built with LUAOT_PROFILE counts the calls of each function, how many
+** times its loops went around, the operand types of its arithmetic
+** instructions and which ways its tests went (see 'luaD_precall' and
+** 'luaV_execute'). This only happens after 'luaF_startprofile'. When a Proto
+** is freed (at the latest, by lua_close) its profile is appended to the
+** profile file, which luaot reads with --profile. (If the program calls
+** 'exit' without closing the state, the live Protos write their profiles at
+** exit. Nothing is written if the process is killed by a signal.) Format:
+**
+**   function <linedefined> <lastlinedefined> <sizecode> <codehash> <ncalls> <source>
+**   pc <pc> <trips> <seen>
+**   ...
+**   end
+**
+** Several functions can start on the same line with the same size (e.g.,
+** '{add = function (a, b) return a + b end, sub = ...}'), so the key also has
+** a hash of the code (see 'codehash'). The same function can appear more than
+** once (e.g., in several runs, or if it was loaded several times); luaot adds
+** up the records. Only functions loaded from files are written, since luaot
+** only compiles those.
+*/
+
+
+/* the profile and its arrays are in one block, so that it is all or nothing */
+#define sizeprofile(f,len) \
+	(sizeof(ZZProfile) + (f)->sizecode * (sizeof(lu_mem) + 1) + (len))
+
+static ZZProfile *newprofile (lua_State *L, Proto *f) {
+  ZZProfile *prof;
+  size_t len = 0;
+  if (f->source != NULL && getstr(f->source)[0] == '@')
+    len = tsslen(f->source);
+  prof = cast(ZZProfile *, luaM_malloc(L, sizeprofile(f, len)));
+  prof->ncalls = 0;
+  prof->trips = cast(lu_mem *, prof + 1);
+  prof->seen = cast(lu_byte *, prof->trips + f->sizecode);
+  /* the source string may be collected before the Proto, so we copy it */
+  prof->source = (len > 0) ? cast(char *, prof->seen + f->sizecode) : NULL;
+  prof->sourcelen = len;
+  memset(prof->trips, 0, f->sizecode * sizeof(lu_mem));
+  memset(prof->seen, 0, f->sizecode);
+  if (len > 0) memcpy(prof->source, getstr(f->source), len);
+  f->profile = prof;
+  return prof;
+}
+
+
+/*
+** 32-bit FNV-1a of the instructions of 'f'. luaot computes the same hash
+** ('CodeHash' in luaot.c) to find the function of each record.
+*/
+static unsigned int codehash (const Proto *f) {
+  unsigned int h = 2166136261u;
+  int pc, b;
+  for (pc = 0; pc < f->sizecode; pc++) {
+    for (b = 0; b < 32; b += 8) {
+      h ^= (f->code[pc] >> b) & 0xff;
+      h *= 16777619u;
+    }
+  }
+  return h & 0xffffffffu;
+}
+
+
+static void writeprofile (FILE *out, const Proto *f, const ZZProfile *prof) {
+  int pc;
+  fprintf(out, "function %d %d %d %u %lu ", f->linedefined,
+               f->lastlinedefined, f->sizecode, codehash(f),
+               (unsigned long)prof->ncalls);
+  fwrite(prof->source, 1, prof->sourcelen, out);
+  fputc('\n', out);
+  for (pc = 0; pc < f->sizecode; pc++) {
+    if (prof->trips[pc] != 0 || prof->seen[pc] != 0)
+      fprintf(out, "pc %d %lu %d\n", pc, (unsigned long)prof->trips[pc],
+                                    prof->seen[pc]);
+  }
+  fputs("end\n", out);
+}
+
+
+static void freeprofile (lua_State *L, Proto *f) {
+  ZZProfile *prof = f->profile;
+  FILE *out = (FILE *)G(L)->aotprofile;
+  if (out != NULL && prof->source != NULL)
+    writeprofile(out, f, prof);
+  luaM_freemem(L, prof, sizeprofile(f, prof->sourcelen));
+  f->profile = NULL;
+}
+
+
+/*
+** The state whose profiles are written by 'exit' (e.g., after an 'os.exit'
+** that does not close the state), if it is still open. There is only one.
+*/
+static lua_State *exitstate = NULL;
+
+static void stopatexit (void) {
+  if (exitstate != NULL)
+    luaF_stopprofile(exitstate);
+}
+
+
+/*
+** Starts collecting profiles. Returns 0 if the file cannot be opened or if
+** this state already has a profile file.
+*/
+int luaF_startprofile (lua_State *L, const char *filename) {
+  static int registered = 0;
+  global_State *g = G(L);
+  FILE *f;
+  if (g->aotprofile != NULL) return 0;
+  f = fopen(filename, "a");
+  if (f == NULL) return 0;
+  g->aotprofile = f;
+  if (exitstate == NULL && (registered || atexit(stopatexit) == 0)) {
+    registered = 1;
+    exitstate = g->mainthread;
+  }
+  return 1;
+}
+
+
+/*
+** Writes the profiles of the Protos that are still alive (none, if the
+** state is being closed) and closes the profile file.
+*/
+void luaF_stopprofile (lua_State *L) {
+  global_State *g = G(L);
+  GCObject *o;
+  if (exitstate != NULL && G(exitstate) == g)
+    exitstate = NULL;
+  if (g->aotprofile != NULL) {
+    for (o = g->allgc; o != NULL; o = o->next) {
+      if (o->tt == LUA_TPROTO && gco2p(o)->profile != NULL)
+        freeprofile(L, gco2p(o));
+    }
+    fclose((FILE *)g->aotprofile);
+    g->aotprofile = NULL;
+  }
+}
+
+
+/* called for every call of a Lua function while profiling */
+void luaF_profilecall (lua_State *L, Proto *f) {
+  ZZProfile *prof = f->profile;
+  if (prof == NULL) prof = newprofile(L, f);
+  prof->ncalls++;
+}
+
+
+static lu_byte seentypes (const TValue *a, const TValue *b) {
+  if (ttisinteger(a) && ttisinteger(b)) return ZZ_SEEN_INTEGER;
+  if (ttisnumber(a) && ttisnumber(b)) return ZZ_SEEN_FLOAT;
+  return ZZ_SEEN_OTHER;
+}
+
+
+#define profRK(x)	(ISK(x) ? k + INDEXK(x) : base + (x))
+
+/* called before the instruction at 'pc' runs */
+void luaF_profileop (Proto *f, const Instruction *pc, const TValue *base,
+                     const TValue *k) {
+  Instruction i = *pc;
+  OpCode o = GET_OPCODE(i);
+  int n = cast_int(pc - f->code);
+  if (OP_ADD <= o && o <= OP_SHR)
+    f->profile->seen[n] |= seentypes(profRK(GETARG_B(i)), profRK(GETARG_C(i)));
+  else if (o == OP_UNM || o == OP_BNOT)
+    f->profile->seen[n] |= seentypes(base + GETARG_B(i), base + GETARG_B(i));
+  else if (o == OP_JMP && GETARG_sBx(i) < 0)
+    f->profile->trips[n]++;
+}
+
+
+/*
+** Called when a test or a loop instruction at 'pc' decides whether to jump.
+** When a test jumps, the following OP_JMP is not fetched, so if it jumps
+** backwards (e.g. in a repeat-until) we count the trip here.
+*/
+void luaF_profilejump (Proto *f, const Instruction *pc, int jumped) {
+  OpCode o = GET_OPCODE(*pc);
+  int n = cast_int(pc - f->code);
+  if (o == OP_FORLOOP || o == OP_TFORLOOP) {
+    if (jumped) f->profile->trips[n]++;
+  }
+  else {
+    f->profile->seen[n] |= (jumped ? ZZ_SEEN_JUMP : ZZ_SEEN_NOJUMP);
+    if (jumped && GETARG_sBx(pc[1]) < 0) f->profile->trips[n + 1]++;
+  }
+}
+
+/* }====================================================== */
+
+
 Proto *luaF_newproto (lua_State *L) {
   GCObject *o = luaC_newobj(L, LUA_TPROTO, sizeof(Proto));
   Proto *f = gco2p(o);
@@ -119,11 +322,14 @@ Proto *luaF_newproto (lua_State *L) {
   f->lastlinedefined = 0;
   f->source = NULL;
   f->magic_implementation = NULL;
+  f->profile = NULL;
+  f->hotcount = 0;
   return f;
 }
 
 
 void luaF_freeproto (lua_State *L, Proto *f) {
+  if (f->profile) freeprofile(L, f);
   luaM_freearray(L, f->code, f->sizecode);
   luaM_freearray(L, f->p, f->sizep);
   luaM_freearray(L, f->k, f->sizek);
@@ -56,6 +56,12 @@ LUAI_FUNC void luaF_close (lua_State *L, StkId level);
 LUAI_FUNC void luaF_freeproto (lua_State *L, Proto *f);
 LUAI_FUNC const char *luaF_getlocalname (const Proto *func, int local_number,
                                          int pc);
+LUAI_FUNC int luaF_startprofile (lua_State *L, const char *filename);
+LUAI_FUNC void luaF_stopprofile (lua_State *L);
+LUAI_FUNC void luaF_profilecall (lua_State *L, Proto *f);
+LUAI_FUNC void luaF_profileop (Proto *f, const Instruction *pc,
+                               const TValue *base, const TValue *k);
+LUAI_FUNC void luaF_profilejump (Proto *f, const Instruction *pc, int jumped);
 
 
 #endif
@@ -54,6 +54,18 @@
 /* separator for open functions in C libraries */
 #define LUA_OFSEP	"_"
 
+/* prefix for the source hash functions in modules compiled by luaot */
+#define LUA_POH		"luaot_hash_"
+
+/* extension of modules compiled by luaot */
+#if !defined(LUA_AOTEXT)
+#if defined(_WIN32)
+#define LUA_AOTEXT	".dll"
+#else
+#define LUA_AOTEXT	".so"
+#endif
+#endif
+
 
 /*
 ** unique key for table in the registry that keeps handles
@@ -557,6 +569,63 @@ static int searcher_Croot (lua_State *L) {
 }
 
 
+/*
+** Hash of the contents of a Lua source file (64-bit FNV-1a), which luaot
+** stores in the modules that it compiles. This must compute the same value as
+** 'SourceHash' in luaot.c. Returns 0 if the file cannot be read.
+*/
+static int sourcehash (const char *filename, lua_Unsigned *h) {
+  FILE *f = fopen(filename, "rb");
+  int c;
+  if (f == NULL) return 0;
+  *h = (lua_Unsigned)0xcbf29ce484222325u;
+  while ((c = getc(f)) != EOF) {
+    *h ^= (lua_Unsigned)c;
+    *h *= (lua_Unsigned)0x100000001b3u;
+  }
+  c = ferror(f);
+  fclose(f);
+  return !c;
+}
+
+
+/*
+** Searcher for modules compiled by luaot. It looks for the Lua file of the
+** module in 'package.path', like 'searcher_Lua'. If next to it there is a
+** compiled module (same name, with extension LUA_AOTEXT) that was compiled
+** from the same source, it loads the compiled module instead. Otherwise
+** it does nothing, so the next searcher can load the Lua file. This searcher
+** is not used by default; it is available as 'package.aotsearcher'.
+*/
+static int searcher_AOT (lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  const char *filename = findfile(L, name, "path", LUA_LSUBSEP);
+  const char *libname;
+  const char *hashfunc;
+  size_t len;
+  lua_Unsigned h;
+  if (filename == NULL) return 0;  /* let 'searcher_Lua' complain */
+  len = strlen(filename);
+  if (len < 4 || strcmp(filename + len - 4, ".lua") != 0) return 0;
+  lua_pushlstring(L, filename, len - 4);
+  libname = lua_pushfstring(L, "%s" LUA_AOTEXT, lua_tostring(L, -1));
+  if (!readable(libname) || !sourcehash(filename, &h)) return 0;
+  hashfunc = luaL_gsub(L, name, ".", LUA_OFSEP);
+  hashfunc = lua_pushfstring(L, LUA_POH"%s", hashfunc);
+  if (lookforfunc(L, libname, hashfunc) != 0) {  /* not compiled by luaot? */
+    lua_pushfstring(L, "\n\tno source hash in file '%s'", libname);
+    return 1;
+  }
+  lua_call(L, 0, 1);
+  if (lua_tointeger(L, -1) != (lua_Integer)h) {
+    lua_pushfstring(L, "\n\tfile '%s' was not compiled from '%s'",
+                       libname, filename);
+    return 1;
+  }
+  return checkload(L, (loadfunc(L, libname, name) == 0), filename);
+}
+
+
 static int searcher_preload (lua_State *L) {
   const char *name = luaL_checkstring(L, 1);
   lua_getfield(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
@@ -747,6 +816,10 @@ static void createsearcherstable (lua_State *L) {
   lua_setfield(L, -3, "loaders");  /* put it in field 'loaders' */
 #endif
   lua_setfield(L, -2, "searchers");  /* put it in field 'searchers' */
+  /* the searcher for compiled modules is optional */
+  lua_pushvalue(L, -1);  /* set 'package' as upvalue */
+  lua_pushcclosure(L, searcher_AOT, 1);
+  lua_setfield(L, -2, "aotsearcher");
 }
 
 
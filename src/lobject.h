@@ -407,6 +407,31 @@ typedef struct LocVar {
 */
 typedef int (*ZZ_MAGIC_FUNC) (/* ARGS */);
 
+/*
+** Returned by a magic function that wants to tail call another magic
+** function. See 'luaD_runmagic'.
+*/
+#define ZZ_MAGIC_TAILCALL	(-1)
+
+/*
+** Run-time profile of a function, for profile-guided AOT compilation
+** (see 'luaF_startprofile'). The bits in 'seen' are the operand types seen
+** by arithmetic instructions and the ways that tests went.
+*/
+#define ZZ_SEEN_INTEGER	1  /* all operands were integers */
+#define ZZ_SEEN_FLOAT	2  /* numbers, but not all of them integers */
+#define ZZ_SEEN_OTHER	4  /* some operand was not a number */
+#define ZZ_SEEN_JUMP	8  /* the test jumped */
+#define ZZ_SEEN_NOJUMP	16  /* the test did not jump */
+
+typedef struct ZZProfile {
+  lu_mem ncalls;  /* number of calls */
+  lu_mem *trips;  /* trips[pc]: times that the backward jump at pc jumped */
+  lu_byte *seen;  /* seen[pc]: ZZ_SEEN_* bits for the instruction at pc */
+  char *source;  /* copy of the source name (outlives the TString) */
+  size_t sourcelen;
+} ZZProfile;
+
 /*
 ** Function Prototypes
 */
@@ -434,6 +459,8 @@ typedef struct Proto {
   GCObject *gclist;
 
   ZZ_MAGIC_FUNC magic_implementation; /* For magic AOT compilation */
+  ZZProfile *profile;  /* NULL unless profiling */
+  unsigned int hotcount;  /* calls counted by the tiered compiler (ltier.c) */
 } Proto;
 
 
@@ -151,6 +151,8 @@ typedef struct global_State {
   TString *tmname[TM_N];  /* array with tag-method names */
   struct Table *mt[LUA_NUMTAGS];  /* metatables for basic types */
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
+  void *aotprofile;  /* FILE where profiles are written (see lfunc.c) */
+  void *aottier;  /* state of the tiered compiler (see ltier.c) */
 } global_State;
 
 
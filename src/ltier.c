@@ -0,0 +1,535 @@
+/*
+** $Id: ltier.c $
+** Tiered AOT compilation of hot functions
+** See Copyright Notice in lua.h
+*/
+
+#define ltier_c
+#define LUA_CORE
+
+#include "lprefix.h"
+
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "ldo.h"
+#include "lgc.h"
+#include "lobject.h"
+#include "lstate.h"
+#include "ltier.h"
+#include "lvm.h"
+
+
+/*
+** {======================================================
+** Tiered compilation
+** =======================================================
+**
+** A VM built with LUAOT_TIER (which needs dlopen and pthreads) counts the
+** calls of each function that does not have a compiled implementation (see
+** 'luaD_precall'). When a function gets hot, a worker thread compiles the
+** whole file it came from with luaot and the C compiler. Only functions
+** loaded from '.lua' files are compiled, since luaot needs the file.
+**
+** The libraries go into a cache directory that outlives the process. Each
+** one is named after the cache key that luaot computes for the file (from
+** its bytecode and constants, the luaot program and the C files that it
+** includes in its output) and after the C compiler command. A file that was
+** compiled before, by this or another process, is not compiled again.
+**
+** The compiled code is installed at the next call of any Lua function, in
+** whichever coroutine makes it (in 'luaD_precall', before the frame of the
+** callee exists), which is a safe point: the luaot_load_ function of the new
+** library loads its own copy of the module, and every live Proto of that file
+** that is identical to one of the compiled Protos (same code and constants)
+** gets its 'magic_implementation'. Functions that are already running
+** continue in the interpreter and use the compiled code from their next
+** call on. A Proto of the file that gets hot after its file was installed
+** (e.g., it was loaded again) triggers the installation again.
+** If the library cannot be loaded, the functions stay in the interpreter.
+** The libraries are never unloaded, since the Protos point into them.
+*/
+
+#if defined(LUAOT_TIER)	/* { */
+
+#include <dlfcn.h>
+#include <pthread.h>
+
+
+/*
+** Some systems (e.g., Linux) complain about converting the result of
+** 'dlsym' (a data pointer) to a function pointer; see loadlib.c.
+*/
+#if defined(__GNUC__)
+#define cast_func(p) (__extension__ (lua_CFunction)(p))
+#else
+#define cast_func(p) ((lua_CFunction)(p))
+#endif
+
+
+/* the library of a job is "<dir>/luaot_<hash>.so" */
+#define JOBNAME		"luaot_%016" LUA_INTEGER_FRMLEN "x"
+#define MAXJOBNAME	64
+
+
+/* states of a job */
+#define JOB_QUEUED	0  /* waiting for the worker */
+#define JOB_RUNNING	1  /* the worker is compiling it */
+#define JOB_DONE	2  /* compiled, waiting to be installed */
+#define JOB_INSTALLED	3
+#define JOB_FAILED	4
+
+
+typedef struct Job {
+  struct Job *next;
+  char *source;  /* name of the Lua file (the chunkname without the '@') */
+  char *path;  /* absolute path of the Lua file */
+  char name[MAXJOBNAME];  /* name of the library (set by the worker) */
+  int state;  /* protected by 'lock' */
+  int pending;  /* being installed (only used by 'installdone') */
+  lua_CFunction load;  /* luaot_load_ function of the library, once loaded */
+} Job;
+
+
+typedef struct Tier {
+  pthread_t worker;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;  /* signals new jobs (and 'stop') to the worker */
+  Job *jobs;  /* list of all jobs, newest first */
+  int ndone;  /* number of jobs in state JOB_DONE (see 'getndone') */
+  int stop;  /* tells the worker to finish */
+  unsigned int threshold;
+  char *dir;  /* cache directory */
+  char *luaot;  /* luaot program */
+  char *cc;  /* command that compiles a C file into a shared library */
+  char *incdir;  /* directory with the luaot-generated-*.c files */
+} Tier;
+
+
+/*
+** 'ndone' is only changed with the lock, but 'luaJ_call' reads it without
+** the lock in every call. That read is only a hint ('installdone' checks the
+** states of the jobs with the lock), so it does not need any ordering, but
+** it must be atomic.
+*/
+#if defined(__GNUC__)
+#define getndone(t)	__atomic_load_n(&(t)->ndone, __ATOMIC_RELAXED)
+#define setndone(t,n)	__atomic_store_n(&(t)->ndone, (n), __ATOMIC_RELAXED)
+#else
+static int getndone (Tier *t) {
+  int n;
+  pthread_mutex_lock(&t->lock);
+  n = t->ndone;
+  pthread_mutex_unlock(&t->lock);
+  return n;
+}
+#define setndone(t,n)	((t)->ndone = (n))
+#endif
+
+
+static char *copystring (const char *s, size_t len) {
+  char *c = (char *)malloc(len + 1);
+  if (c != NULL) {
+    memcpy(c, s, len);
+    c[len] = '\0';
+  }
+  return c;
+}
+
+
+/* name of the library of a job */
+static char *jobfile (Tier *t, Job *job) {
+  char *path = (char *)malloc(strlen(t->dir) + strlen(job->name) + 5);
+  if (path != NULL)
+    sprintf(path, "%s/%s.so", t->dir, job->name);
+  return path;
+}
+
+
+/* 64-bit FNV-1a, like 'sourcehash' in loadlib.c */
+static void hashbytes (lua_Unsigned *h, const char *s, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    *h ^= (lua_Unsigned)(unsigned char)s[i];
+    *h *= (lua_Unsigned)0x100000001b3u;
+  }
+}
+
+
+/*
+** Names the library of a job after its cache key, which 'luaot --cache-key'
+** computes from the bytecode of the file, the options and luaot itself, and
+** after the C compiler command. (The output name of the key is always
+** "luaot.c", since the library is named after the key.)
+*/
+static int hashjob (Tier *t, Job *job) {
+  static const char fmt[] = "'%s' --cache-key '%s' -o luaot.c";
+  char key[64];
+  char *cmd;
+  FILE *f;
+  int ok;
+  lua_Unsigned h = (lua_Unsigned)0xcbf29ce484222325u;
+  cmd = (char *)malloc(sizeof(fmt) + strlen(t->luaot) + strlen(job->path));
+  if (cmd == NULL) return 0;
+  sprintf(cmd, fmt, t->luaot, job->path);
+  f = popen(cmd, "r");
+  free(cmd);
+  if (f == NULL) return 0;
+  ok = (fgets(key, sizeof(key), f) != NULL);
+  if (pclose(f) != 0 || !ok) return 0;
+  hashbytes(&h, key, strlen(key));
+  hashbytes(&h, t->cc, strlen(t->cc));
+  sprintf(job->name, JOBNAME, (LUAI_UACINT)h);
+  return 1;
+}
+
+
+/*
+** Compiles a job, in the worker thread (without the lock), unless its
+** library is already in the cache. The C file is compiled in a temporary
+** directory and the library is then moved to the cache, so that other
+** processes never see half-written libraries. The file names are quoted
+** for the shell, and 'luaJ_starttier' and 'submit' refuse names with
+** quotes.
+*/
+static int compile (Tier *t, Job *job) {
+  static const char fmt[] =
+    "mkdir -p '%s' && T=$(mktemp -d '%s/tmp.XXXXXX') && "
+    "'%s' '%s' -o \"$T/%s.c\" && %s -I'%s' -o \"$T/%s.so\" \"$T/%s.c\" && "
+    "mv \"$T/%s.so\" '%s/%s.so'; S=$?; rm -rf \"$T\"; exit $S";
+  char *cmd, *lib;
+  FILE *f;
+  int ok;
+  if (!hashjob(t, job) || (lib = jobfile(t, job)) == NULL)
+    return 0;
+  f = fopen(lib, "rb");
+  free(lib);
+  if (f != NULL) {  /* already in the cache? */
+    fclose(f);
+    return 1;
+  }
+  cmd = (char *)malloc(sizeof(fmt) + 3 * strlen(t->dir) + strlen(t->luaot) +
+                       strlen(job->path) + 4 * strlen(job->name) +
+                       strlen(t->cc) + strlen(t->incdir));
+  if (cmd == NULL) return 0;
+  sprintf(cmd, fmt, t->dir, t->dir, t->luaot, job->path, job->name, t->cc,
+                    t->incdir, job->name, job->name, job->name, t->dir,
+                    job->name);
+  ok = (system(cmd) == 0);
+  free(cmd);
+  return ok;
+}
+
+
+static void *worker (void *ud) {
+  Tier *t = (Tier *)ud;
+  pthread_mutex_lock(&t->lock);
+  while (!t->stop) {
+    Job *job;
+    for (job = t->jobs; job != NULL; job = job->next)
+      if (job->state == JOB_QUEUED) break;
+    if (job == NULL)  /* nothing to do? */
+      pthread_cond_wait(&t->cond, &t->lock);
+    else {
+      int ok;
+      job->state = JOB_RUNNING;
+      pthread_mutex_unlock(&t->lock);
+      ok = compile(t, job);
+      pthread_mutex_lock(&t->lock);
+      job->state = ok ? JOB_DONE : JOB_FAILED;
+      if (ok) setndone(t, t->ndone + 1);
+    }
+  }
+  pthread_mutex_unlock(&t->lock);
+  return NULL;
+}
+
+
+/*
+** Queues the file of a hot function, unless it was queued already. If the
+** file was already installed, the function must be newer than the
+** installation, so the file is installed again. The job gets the absolute
+** path of the file, since the program may change its current directory
+** before the worker gets to it.
+*/
+static void submit (Tier *t, Proto *p) {
+  const char *source;
+  size_t len;
+  Job *job;
+  if (p->source == NULL || getstr(p->source)[0] != '@')
+    return;  /* not loaded from a file */
+  source = getstr(p->source) + 1;
+  len = tsslen(p->source) - 1;
+  if (len < 4 || strcmp(source + len - 4, ".lua") != 0 ||
+      strchr(source, '\'') != NULL)
+    return;  /* luaot cannot compile it */
+  pthread_mutex_lock(&t->lock);
+  for (job = t->jobs; job != NULL; job = job->next) {
+    if (strcmp(job->source, source) == 0) {
+      if (job->state == JOB_INSTALLED) {
+        job->state = JOB_DONE;
+        setndone(t, t->ndone + 1);
+      }
+      break;
+    }
+  }
+  if (job == NULL && (job = (Job *)malloc(sizeof(Job))) != NULL) {
+    job->source = copystring(source, len);
+    job->path = realpath(source, NULL);
+    if (job->source == NULL || job->path == NULL ||
+        strchr(job->path, '\'') != NULL) {
+      free(job->source);
+      free(job->path);
+      free(job);
+    }
+    else {
+      job->state = JOB_QUEUED;
+      job->pending = 0;
+      job->load = NULL;
+      job->next = t->jobs;
+      t->jobs = job;
+      pthread_cond_signal(&t->cond);
+    }
+  }
+  pthread_mutex_unlock(&t->lock);
+}
+
+
+/*
+** Whether the compiled code of 'f' can run 'p'. The compiled code may have
+** the instructions and numeric constants of its Proto embedded in it.
+*/
+static int sameproto (const Proto *p, const Proto *f) {
+  int i;
+  if (p->sizecode != f->sizecode || p->sizek != f->sizek ||
+      p->sizep != f->sizep || p->sizeupvalues != f->sizeupvalues ||
+      p->numparams != f->numparams || p->is_vararg != f->is_vararg ||
+      p->maxstacksize != f->maxstacksize || p->linedefined != f->linedefined)
+    return 0;
+  if (memcmp(p->code, f->code, p->sizecode * sizeof(Instruction)) != 0)
+    return 0;
+  for (i = 0; i < p->sizek; i++) {  /* (1 and 1.0 are not the same here) */
+    if (rttype(p->k + i) != rttype(f->k + i) ||
+        !luaV_rawequalobj(p->k + i, f->k + i))
+      return 0;
+  }
+  return 1;
+}
+
+
+/* finds a compiled function for 'p' among 'f' and its nested functions */
+static ZZ_MAGIC_FUNC findcompiled (const Proto *p, const Proto *f) {
+  int i;
+  if (f->magic_implementation != NULL && sameproto(p, f))
+    return f->magic_implementation;
+  for (i = 0; i < f->sizep; i++) {
+    ZZ_MAGIC_FUNC impl = findcompiled(p, f->p[i]);
+    if (impl != NULL) return impl;
+  }
+  return NULL;
+}
+
+
+/*
+** Gives the compiled functions in 'fresh' (the main function of a module
+** loaded by a luaot_load_ function) to the live Protos of the same file.
+** This does not allocate anything, so the GC does not run while it walks
+** the list of all objects.
+*/
+static void patchprotos (lua_State *L, const char *source, const Proto *fresh) {
+  GCObject *o;
+  for (o = G(L)->allgc; o != NULL; o = o->next) {
+    if (o->tt == LUA_TPROTO) {
+      Proto *p = gco2p(o);
+      if (p->magic_implementation == NULL && p->source != NULL &&
+          getstr(p->source)[0] == '@' &&
+          strcmp(getstr(p->source) + 1, source) == 0)
+        p->magic_implementation = findcompiled(p, fresh);
+    }
+  }
+}
+
+
+/* calls the luaot_load_ function of a job, in protected mode */
+static void callload (lua_State *L, void *ud) {
+  Job *job = (Job *)ud;
+  setfvalue(L->top, job->load);
+  L->top++;
+  luaD_callnoyield(L, L->top - 1, 1);
+}
+
+
+/* returns 0 if the library cannot be loaded */
+static int install (lua_State *L, Tier *t, Job *job) {
+  ptrdiff_t oldtop = savestack(L, L->top);
+  if (job->load == NULL) {  /* first installation? */
+    char sym[MAXJOBNAME + sizeof("luaot_load_")];
+    char *path = jobfile(t, job);
+    void *lib;
+    if (path == NULL) return 0;
+    lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    free(path);
+    if (lib == NULL) return 0;
+    sprintf(sym, "luaot_load_%s", job->name);
+    job->load = cast_func(dlsym(lib, sym));
+    if (job->load == NULL) {
+      dlclose(lib);
+      return 0;
+    }
+  }
+  luaD_checkstack(L, 1);
+  if (luaD_pcall(L, callload, job, oldtop, 0) != LUA_OK)
+    return 0;  /* (the error message is gone, 'luaD_pcall' restored the top) */
+  patchprotos(L, job->source, clLvalue(L->top - 1)->p);
+  L->top--;
+  return 1;
+}
+
+
+/* installs all the jobs that the worker finished */
+static void installdone (lua_State *L, Tier *t) {
+  Job *job;
+  pthread_mutex_lock(&t->lock);
+  for (job = t->jobs; job != NULL; job = job->next) {
+    if (job->state == JOB_DONE) {
+      job->state = JOB_INSTALLED;
+      job->pending = 1;
+    }
+  }
+  setndone(t, 0);
+  pthread_mutex_unlock(&t->lock);
+  /* the worker never changes the list, and 'submit' only adds to its head */
+  for (job = t->jobs; job != NULL; job = job->next) {
+    if (job->pending) {
+      job->pending = 0;
+      if (!install(L, t, job)) {
+        pthread_mutex_lock(&t->lock);
+        job->state = JOB_FAILED;
+        pthread_mutex_unlock(&t->lock);
+      }
+    }
+  }
+}
+
+
+/*
+** Called by 'luaD_precall' for every call of a Lua function, when the
+** tiered compiler is on.
+*/
+void luaJ_call (lua_State *L, Proto *p) {
+  Tier *t = (Tier *)G(L)->aottier;
+  if (getndone(t) > 0)
+    installdone(L, t);
+  if (p->magic_implementation == NULL && ++p->hotcount == t->threshold)
+    submit(t, p);
+}
+
+
+static void freetier (Tier *t) {
+  while (t->jobs != NULL) {
+    Job *job = t->jobs;
+    t->jobs = job->next;
+    free(job->source);
+    free(job->path);
+    free(job);
+  }
+  free(t->dir);
+  free(t->luaot);
+  free(t->cc);
+  free(t->incdir);
+  free(t);
+}
+
+
+/*
+** Starts the tiered compiler. Libraries are cached in 'dir', 'luaot' is the
+** luaot program (its directory must also have the luaot-generated-*.c
+** files) and 'cc' is a command that compiles a C file into a shared
+** library. Returns 0 if this state already has a tiered compiler or if the
+** worker cannot be started.
+*/
+int luaJ_starttier (lua_State *L, const char *dir, const char *luaot,
+                    const char *cc, unsigned int threshold) {
+  global_State *g = G(L);
+  const char *slash = strrchr(luaot, '/');
+  Tier *t;
+  if (g->aottier != NULL || threshold == 0 || *dir == '\0' ||
+      strchr(dir, '\'') != NULL || strchr(luaot, '\'') != NULL)
+    return 0;
+  t = (Tier *)malloc(sizeof(Tier));
+  if (t == NULL) return 0;
+  t->jobs = NULL;
+  t->ndone = 0;
+  t->stop = 0;
+  t->threshold = threshold;
+  t->dir = copystring(dir, strlen(dir));
+  t->luaot = copystring(luaot, strlen(luaot));
+  t->cc = copystring(cc, strlen(cc));
+  if (slash == NULL)
+    t->incdir = copystring(".", 1);
+  else
+    t->incdir = copystring(luaot, slash - luaot);
+  if (t->dir == NULL || t->luaot == NULL || t->cc == NULL ||
+      t->incdir == NULL) {
+    freetier(t);
+    return 0;
+  }
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_cond_init(&t->cond, NULL);
+  if (pthread_create(&t->worker, NULL, worker, t) != 0) {
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    freetier(t);
+    return 0;
+  }
+  g->aottier = t;
+  return 1;
+}
+
+
+/*
+** Stops the tiered compiler, waiting for the file being compiled (if any).
+** Queued files are not compiled.
+*/
+void luaJ_stoptier (lua_State *L) {
+  global_State *g = G(L);
+  Tier *t = (Tier *)g->aottier;
+  if (t == NULL) return;
+  pthread_mutex_lock(&t->lock);
+  t->stop = 1;
+  pthread_cond_signal(&t->cond);
+  pthread_mutex_unlock(&t->lock);
+  pthread_join(t->worker, NULL);
+  pthread_cond_destroy(&t->cond);
+  pthread_mutex_destroy(&t->lock);
+  freetier(t);
+  g->aottier = NULL;
+}
+
+#else				/* }{ */
+
+int luaJ_starttier (lua_State *L, const char *dir, const char *luaot,
+                    const char *cc, unsigned int threshold) {
+  UNUSED(L); UNUSED(dir); UNUSED(luaot); UNUSED(cc); UNUSED(threshold);
+  return 0;  /* not available */
+}
+
+
+void luaJ_stoptier (lua_State *L) {
+  UNUSED(L);
+}
+
+
+void luaJ_call (lua_State *L, Proto *p) {
+  UNUSED(L); UNUSED(p);
+}
+
+#endif				/* } */
+
+/* }====================================================== */
+
@@ -0,0 +1,28 @@
+/*
+** $Id: ltier.h $
+** Tiered AOT compilation of hot functions
+** See Copyright Notice in lua.h
+*/
+
+#ifndef ltier_h
+#define ltier_h
+
+
+#include "lobject.h"
+
+
+/* default number of calls that make a function hot */
+#define LUAJ_THRESHOLD	1000
+
+/* default command that compiles the output of luaot into a shared library */
+#define LUAJ_CC		"cc -O2 -fPIC -shared"
+
+
+LUAI_FUNC int luaJ_starttier (lua_State *L, const char *dir,
+                              const char *luaot, const char *cc,
+                              unsigned int threshold);
+LUAI_FUNC void luaJ_stoptier (lua_State *L);
+LUAI_FUNC void luaJ_call (lua_State *L, Proto *p);
+
+
+#endif
@@ -547,6 +547,89 @@ static int handle_luainit (lua_State *L) {
 }
 
 
+#if defined(LUAOT_PROFILE)
+
+#include "lfunc.h"
+
+/*
+** In a VM built with LUAOT_PROFILE, the variable LUAOT_PROFILE names a file
+** where the run-time profile for 'luaot --profile' is appended at exit
+** (see lfunc.c; a process killed by a signal writes nothing).
+*/
+static int handle_aotprofile (lua_State *L) {
+  const char *filename = getenv("LUAOT_PROFILE");
+  if (filename != NULL && !luaF_startprofile(L, filename)) {
+    l_message(progname, lua_pushfstring(L, "cannot open profile file '%s'",
+                                           filename));
+    return 0;
+  }
+  return 1;
+}
+
+#else
+
+#define handle_aotprofile(L)	1
+
+#endif
+
+
+#if defined(LUAOT_TIER)
+
+#include "ltier.h"
+
+/*
+** In a VM built with LUAOT_TIER, the variable LUAOT_TIER turns on the tiered
+** compiler (see ltier.c), which compiles hot Lua files with luaot in the
+** background. It names the directory where the compiled files are cached
+** (if it is empty, $XDG_CACHE_HOME/luaot or ~/.cache/luaot).
+** LUAOT_TIER_LUAOT is the luaot program (by default, the one next to this
+** program), LUAOT_TIER_CC the command that compiles its output into a shared
+** library and LUAOT_TIER_THRESHOLD the number of calls that make a function
+** hot.
+*/
+static int handle_aottier (lua_State *L) {
+  const char *dir = getenv("LUAOT_TIER");
+  const char *luaot = getenv("LUAOT_TIER_LUAOT");
+  const char *cc = getenv("LUAOT_TIER_CC");
+  const char *threshold = getenv("LUAOT_TIER_THRESHOLD");
+  unsigned long n = LUAJ_THRESHOLD;
+  if (dir == NULL)
+    return 1;
+  if (*dir == '\0') {  /* default cache directory? */
+    const char *home = getenv("XDG_CACHE_HOME");
+    if (home != NULL && *home != '\0')
+      dir = lua_pushfstring(L, "%s/luaot", home);
+    else if ((home = getenv("HOME")) != NULL)
+      dir = lua_pushfstring(L, "%s/.cache/luaot", home);
+  }
+  if (luaot == NULL) {
+    const char *slash = strrchr(progname, '/');
+    if (slash == NULL)
+      luaot = "luaot";
+    else {
+      lua_pushlstring(L, progname, slash - progname);
+      luaot = lua_pushfstring(L, "%s/luaot", lua_tostring(L, -1));
+    }
+  }
+  if (cc == NULL)
+    cc = LUAJ_CC;
+  if (threshold != NULL)
+    n = strtoul(threshold, NULL, 10);
+  if (!luaJ_starttier(L, dir, luaot, cc, (unsigned int)n)) {
+    l_message(progname, lua_pushfstring(L,
+                          "cannot start the tiered compiler in '%s'", dir));
+    return 0;
+  }
+  return 1;
+}
+
+#else
+
+#define handle_aottier(L)	1
+
+#endif
+
+
 /*
 ** Main body of stand-alone interpreter (to be called in protected mode).
 ** Reads the options and handles them all.
@@ -571,6 +654,8 @@ static int pmain (lua_State *L) {
   luaL_openlibs(L);  /* open standard libraries */
   createargtable(L, argv, argc, script);  /* create table 'arg' */
   if (!(args & has_E)) {  /* no option '-E'? */
+    if (!handle_aotprofile(L) || !handle_aottier(L))
+      return 0;
     if (handle_luainit(L) != LUA_OK)  /* run LUA_INIT */
       return 0;  /* error running LUA_INIT */
   }
@@ -11,34 +11,66 @@ static void bind_magic(Proto *p, int *next_id)
     }
 }
 
-int ZZ_LUAOPEN_NAME (lua_State *L) {
-    
-    int ok = luaL_loadstring(L, ZZ_ORIGINAL_SOURCE_CODE);
-    switch (ok) {
-      case LUA_OK:
-        /* No errors */
-        break;
-      case LUA_ERRSYNTAX:
-        fprintf(stderr, "syntax error in bundled source code.\n");
-        exit(1);
-        break;
-      case LUA_ERRMEM:
-        fprintf(stderr, "memory allocation (out-of-memory) error in bundled source code.\n");
-        exit(1);
-        break;
-      case LUA_ERRGCMM:
-        fprintf(stderr, "error while running a __gc metamethod.\n");
-        exit(1);
-        break;
-      default:
-        assert(0);
-    }
+/*
+** Loads the bytecode of the module and binds its magic functions, which start
+** at 'first_id'. Leaves the main function on the stack. Raises an error if
+** the bytecode cannot be loaded (e.g., out of memory).
+*/
+static void zz_load_module (lua_State *L, const unsigned char *bytecode,
+                            size_t size, const char *name, int first_id) {
+
+    if (luaL_loadbufferx(L, (const char *) bytecode, size, name, "b") != LUA_OK)
+        lua_error(L);  /* the error message is on the stack */
 
     LClosure *cl = (void *) lua_topointer(L, -1);
 
-    int next_id = 0;
+    int next_id = first_id;
     bind_magic(cl->p, &next_id);
+}
 
-    lua_call(L, 0, 1);
+/*
+** Behaves like the chunk of the original Lua file: the arguments (under
+** 'require', the module name and the file name) are passed on to the chunk.
+*/
+static int zz_open_module (lua_State *L, const unsigned char *bytecode,
+                           size_t size, const char *name, int first_id) {
+
+    int nargs = lua_gettop(L);
+    zz_load_module(L, bytecode, size, name, first_id);
+    lua_insert(L, 1);
+    lua_call(L, nargs, 1);
     return 1;
 }
+
+/*
+** The luaopen_ function of each module, a luaot_hash_ function that
+** package.aotsearcher uses to check that the module is up to date, and a
+** luaot_load_ function that returns the main function of the module without
+** running it (for the tiered compiler in ltier.c).
+*/
+#define ZZ_DEFINE_MODULE(cname, modname, bytecode, first_id, source_hash) \
+    int luaot_hash_##cname (lua_State *L) { \
+        lua_pushinteger(L, source_hash); \
+        return 1; \
+    } \
+    int luaot_load_##cname (lua_State *L) { \
+        zz_load_module(L, bytecode, sizeof(bytecode), modname, first_id); \
+        return 1; \
+    } \
+    int luaopen_##cname (lua_State *L) { \
+        return zz_open_module(L, bytecode, sizeof(bytecode), modname, first_id); \
+    }
+
+/*
+** When several modules are compiled together, the luaopen_ function of the
+** whole library puts all of them in package.preload.
+*/
+static ZZ_COLD void zz_preload_modules (lua_State *L, const luaL_Reg *modules)
+{
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+    for (; modules->name != NULL; modules++) {
+        lua_pushcfunction(L, modules->func);
+        lua_setfield(L, -2, modules->name);
+    }
+    lua_pop(L, 1);
+}
@@ -20,6 +20,7 @@
 #include "lstate.h"
 #include "lstring.h"
 #include "ltable.h"
+#include "ltier.h"
 #include "ltm.h"
 #include "lvm.h"
 
@@ -71,11 +72,83 @@
 	ISK(GETARG_C(i)) ? k+INDEXK(GETARG_C(i)) : base+GETARG_C(i))
 
 
-#define Protect(x)	{ {x;}; base = ci->u.l.base; }
+/*
+** Branch prediction hints for the generated code. The rarely used slow paths
+** (metamethods, hooks) call the cold functions below, which tells the C
+** compiler to move them out of the way of the fast paths.
+*/
+#if defined(__GNUC__)
+#define zz_likely(x)	(__builtin_expect(((x) != 0), 1))
+#define zz_unlikely(x)	(__builtin_expect(((x) != 0), 0))
+#define ZZ_COLD	__attribute__((cold, noinline, unused))
+#else
+#define zz_likely(x)	(x)
+#define zz_unlikely(x)	(x)
+#define ZZ_COLD
+#endif
+
+static ZZ_COLD void zz_trybinTM (lua_State *L, const TValue *p1,
+                                 const TValue *p2, StkId res, TMS event) {
+  luaT_trybinTM(L, p1, p2, res, event);
+}
+
+static ZZ_COLD void zz_arith (lua_State *L, int op, const TValue *p1,
+                              const TValue *p2, StkId res) {
+  luaO_arith(L, op, p1, p2, res);
+}
 
+static ZZ_COLD void zz_traceexec (lua_State *L) {
+  luaG_traceexec(L);
+}
+
+static ZZ_COLD l_noret zz_reloaderror (lua_State *L) {
+  luaG_runerror(L, "cannot change the type of this local variable "
+                   "of a compiled function");
+}
+
+
+/*
+** The generated functions are static, unless luaot split them into several C
+** files (--shards). Then they are hidden, so that they don't clash with the
+** functions of other modules.
+*/
+#if !defined(ZZ_SHARDED)
+#define ZZ_FUNC	static
+#elif defined(__GNUC__)
+#define ZZ_FUNC	extern __attribute__((visibility("hidden")))
+#else
+#define ZZ_FUNC	extern
+#endif
+
+
+/*
+** Functions that keep some registers in C local variables redefine this to
+** write them back to the stack before anything can look at the stack. In
+** the body of a loop whose tables were checked by its FORPREP, it also
+** clears the flag with the result of the checks, because the code that runs
+** here might change the tables.
+*/
+#define ZZ_SPILL() ((void)0)
+
+/*
+** ...and this to read back the ones that are still needed after the code in
+** a Protect, which may have changed them with debug.setlocal. The C local
+** has a fixed type, so a value of another type is an error.
+*/
+#define ZZ_RELOAD() ((void)0)
+
+#define zz_reloadint(L,o,v)  \
+	{ if (zz_unlikely(!ttisinteger(o))) zz_reloaderror(L); v = ivalue(o); }
+#define zz_reloadflt(L,o,v)  \
+	{ if (zz_unlikely(!ttisfloat(o))) zz_reloaderror(L); v = fltvalue(o); }
+
+#define Protect(x)	{ ZZ_SPILL(); {x;}; base = ci->u.l.base; ZZ_RELOAD(); }
+
+/* The spill comes before the step, which may move the stack. There is no
+   reload, because the step may clear the stack above c. */
 #define checkGC(L,c)  \
-	{ luaC_condGC(L, L->top = (c),  /* limit of live values */ \
-                         Protect(L->top = ci->top));  /* restore top */ \
+	{ luaC_condGC(L, {ZZ_SPILL(); L->top = (c);},  /* limit of live values */ \
+                         {L->top = ci->top; base = ci->u.l.base;});  /* restore top */ \
            luai_threadyield(L); }
 
 
@@ -84,11 +157,249 @@
 ** metamethod (which can reallocate the stack)
 */
 #define gettableProtected(L,t,k,v)  { const TValue *slot; \
-  if (luaV_fastget(L,t,k,slot,luaH_get)) { setobj2s(L, v, slot); } \
+  if (zz_likely(luaV_fastget(L,t,k,slot,luaH_get))) { setobj2s(L, v, slot); } \
   else Protect(luaV_finishget(L,t,k,v,slot)); }
 
 
 /* same for 'luaV_settable' */
 #define settableProtected(L,t,k,v) { const TValue *slot; \
-  if (!luaV_fastset(L,t,k,slot,luaH_get,v)) \
+  if (zz_unlikely(!luaV_fastset(L,t,k,slot,luaH_get,v))) \
     Protect(luaV_finishset(L,t,k,v,slot)); }
+
+
+/*
+** Accesses with a key that is probably an integer look in the array part
+** inline (like 'luaH_getint') before calling 'luaH_get'. A store into the
+** array part can skip 'luaV_finishset' when the old value is not nil or
+** when there is no metatable (so no __newindex). Integer keys are never
+** metamethod names, so there is no need for 'invalidateTMcache'.
+*/
+#define zz_inarray(t,k) \
+  (ttisinteger(k) && l_castS2U(ivalue(k)) - 1u < (t)->sizearray)
+
+#define gettableInt(L,t,k,v)  { const TValue *slot; \
+  if (zz_likely(ttistable(t) && zz_inarray(hvalue(t), k) && \
+      (slot = &hvalue(t)->array[ivalue(k) - 1], !ttisnil(slot)))) \
+    { setobj2s(L, v, slot); } \
+  else gettableProtected(L,t,k,v); }
+
+#define settableInt(L,t,k,v) { \
+  if (zz_likely(ttistable(t) && zz_inarray(hvalue(t), k) && \
+      (hvalue(t)->metatable == NULL || \
+       !ttisnil(&hvalue(t)->array[ivalue(k) - 1])))) { \
+    Table *h = hvalue(t); \
+    setobj2t(L, &h->array[ivalue(k) - 1], v); \
+    luaC_barrierback(L, h, v); } \
+  else settableProtected(L,t,k,v); }
+
+/*
+** The check that a FORPREP does once for the table 't' in a loop whose
+** index goes from 'init' to 'limit' (in any direction). While it holds the
+** accesses with the index as the key can use the array part directly.
+*/
+#define zz_arrayguard(t,init,limit) \
+  (ttistable(t) && hvalue(t)->metatable == NULL && \
+   l_castS2U(init) - 1u < hvalue(t)->sizearray && \
+   l_castS2U(limit) - 1u < hvalue(t)->sizearray)
+
+/*
+** The integer FORLOOP wraps around when 'limit + step' overflows, so then
+** the index may leave [init, limit]. This checks that it cannot.
+*/
+#define zz_forstepfits(limit,step) \
+  ((step) > 0 ? (limit) <= LUA_MAXINTEGER - (step) \
+              : (limit) >= LUA_MININTEGER - (step))
+
+
+/*
+** Inline cache for an access with a constant short-string key, such as a
+** global variable or a record field. Each site has a static 'hint' with the
+** index of the node where it last found the key. Records built the same way
+** have the same size and their keys in the same nodes, so one hint works
+** for all of them. Since short strings are interned, checking that the node
+** still has the key is one pointer comparison, and that stays valid however
+** the table changes (a rehash or a new key that moves the node just makes
+** the next access miss). On a miss, the usual lookup updates the hint.
+*/
+static ZZ_COLD const TValue *zz_getshortstr_miss (Table *t, TString *key,
+                                                  unsigned int *hint) {
+    const TValue *slot = luaH_getshortstr(t, key);
+    if (slot != luaO_nilobject)  /* found it in the hash part? */
+        *hint = cast(unsigned int, cast(const Node *, slot) - t->node);
+    return slot;
+}
+
+static inline const TValue *zz_getshortstr_cached (Table *t, TString *key,
+                                                   unsigned int *hint) {
+    unsigned int i = *hint;
+    if (zz_likely(i < cast(unsigned int, sizenode(t)))) {
+        Node *n = gnode(t, i);
+        if (zz_likely(ttisshrstring(gkey(n)) && tsvalue(gkey(n)) == key))
+            return gval(n);
+    }
+    return zz_getshortstr_miss(t, key, hint);
+}
+
+/* 'luaV_fastget' and 'luaV_fastset' with a cached lookup */
+#define zz_fastgetcached(t,k,slot,hint) \
+  (!ttistable(t) \
+   ? (slot = NULL, 0) \
+   : (slot = zz_getshortstr_cached(hvalue(t), tsvalue(k), hint), \
+      !ttisnil(slot)))
+
+#define zz_fastsetcached(L,t,k,slot,hint,v) \
+  (!ttistable(t) \
+   ? (slot = NULL, 0) \
+   : (slot = zz_getshortstr_cached(hvalue(t), tsvalue(k), hint), \
+     ttisnil(slot) ? 0 \
+     : (luaC_barrierback(L, hvalue(t), v), \
+        setobj2t(L, cast(TValue *,slot), v), \
+        1)))
+
+/* 'gettableProtected' and 'settableProtected' with a cached lookup */
+#define gettableCached(L,t,k,v,hint)  { const TValue *slot; \
+  if (zz_likely(zz_fastgetcached(t,k,slot,hint))) { setobj2s(L, v, slot); } \
+  else Protect(luaV_finishget(L,t,k,v,slot)); }
+
+#define settableCached(L,t,k,v,hint) { const TValue *slot; \
+  if (zz_unlikely(!zz_fastsetcached(L,t,k,slot,hint,v))) \
+    Protect(luaV_finishset(L,t,k,v,slot)); }
+
+
+/* 'luaH_getshortstr', inline */
+static inline const TValue *zz_getshortstr (Table *t, TString *key) {
+    Node *n = gnode(t, lmod(key->hash, sizenode(t)));
+    for (;;) {
+        if (ttisshrstring(gkey(n)) && tsvalue(gkey(n)) == key)
+            return gval(n);
+        if (gnext(n) == 0)
+            return luaO_nilobject;
+        n += gnext(n);
+    }
+}
+
+/*
+** Method lookup for OP_SELF, for the usual case where the method is not in
+** the object but in the __index table of its metatable (a class), or in
+** the string library for a string. The lookups of "__index" in the
+** metatable and of the method in the class use the inline cache above,
+** with one hint each in 'hints'. Returns NULL if the method is somewhere
+** else (e.g., an __index function or a longer __index chain), and then
+** 'luaV_finishget' must do the lookup with 'slot'.
+*/
+static inline const TValue *zz_getmethod (lua_State *L, const TValue *t,
+                                          TString *key, unsigned int *hints,
+                                          const TValue **slot) {
+    Table *mt;
+    const TValue *tm, *m;
+    if (ttistable(t)) {
+        *slot = zz_getshortstr(hvalue(t), key);
+        if (!ttisnil(*slot))  /* the object has the method itself? */
+            return *slot;
+        mt = hvalue(t)->metatable;
+    } else if (ttisstring(t)) {
+        *slot = NULL;
+        mt = G(L)->mt[LUA_TSTRING];
+    } else {
+        *slot = NULL;
+        return NULL;
+    }
+    if (zz_unlikely(mt == NULL))
+        return NULL;
+    tm = zz_getshortstr_cached(mt, G(L)->tmname[TM_INDEX], &hints[0]);
+    if (zz_unlikely(!ttistable(tm)))
+        return NULL;
+    m = zz_getshortstr_cached(hvalue(tm), key, &hints[1]);
+    return ttisnil(m) ? NULL : m;
+}
+
+
+/*
+** Builds the frame for a call to a Lua function that was also compiled by
+** luaot. This does the same frame setup as 'luaD_precall' (and tells the
+** profiler and the tiered compiler about the call), for a non-vararg function
+** whose caller already checked that there is enough stack.
+*/
+static inline CallInfo *zz_magic_frame(lua_State *L, StkId func, int nresults,
+                                       Proto *p) {
+  CallInfo *ci;
+  int n;
+  if (zz_unlikely(G(L)->aottier != NULL)) {  /* tiered compilation? */
+    ptrdiff_t funcr = savestack(L, func);
+    luaJ_call(L, p);  /* (may install compiled code and move the stack) */
+    luaD_checkstack(L, p->maxstacksize);  /* (...or let the GC shrink it) */
+    func = restorestack(L, funcr);
+  }
+  for (n = cast_int(L->top - func) - 1; n < p->numparams; n++)
+    setnilvalue(L->top++);  /* complete missing arguments */
+  ci = L->ci = (L->ci->next ? L->ci->next : luaE_extendCI(L));
+  ci->nresults = nresults;
+  ci->func = func;
+  ci->u.l.base = func + 1;
+  L->top = ci->top = func + 1 + p->maxstacksize;
+  ci->u.l.savedpc = p->code;
+  ci->callstatus = CIST_LUA;
+  if (zz_unlikely(G(L)->aotprofile != NULL))  /* profiling for luaot? */
+    luaF_profilecall(L, p);  /* so that luaot knows that 'p' runs */
+  return ci;
+}
+
+/*
+** Shortcut for calling a Lua function that was also compiled by luaot: calls
+** its magic function right away. Only handles the common case of a non-vararg
+** function when there is enough stack and no call hook; otherwise returns 0
+** and the caller should fall back to 'luaD_precall'.
+*/
+static inline int zz_precall_magic(lua_State *L, StkId func, int nresults) {
+  Proto *p;
+  if (!ttisLclosure(func)) return 0;
+  p = clLvalue(func)->p;
+  if (p->magic_implementation == NULL || p->is_vararg) return 0;
+  if (L->stack_last - L->top <= p->maxstacksize) return 0;
+  if (L->hookmask & LUA_MASKCALL) return 0;
+  luaD_runmagic(L, zz_magic_frame(L, func, nresults, p));
+  return 1;
+}
+
+
+static ZZ_COLD void zz_finish_tailcall (lua_State *L, CallInfo *ci) {
+  luaD_magictailcall(L, ci);
+  luaD_runmagic(L, ci);
+}
+
+/*
+** Call site where luaot guessed which of its functions is being called. When
+** the guess is right we call the C function directly instead of going through
+** the Proto, which lets the C compiler see (and maybe inline) the callee. The
+** guess is checked on every call, so it is fine if the program changes the
+** binding later. 'f' must not be a vararg function.
+*/
+static inline int zz_precall_direct(lua_State *L, StkId func, int nresults,
+                                    int (*f)(lua_State *, LClosure *)) {
+  LClosure *ncl;
+  CallInfo *ci;
+  if (!ttisLclosure(func) ||
+      clLvalue(func)->p->magic_implementation != (ZZ_MAGIC_FUNC) f)
+    return zz_precall_magic(L, func, nresults);
+  ncl = clLvalue(func);
+  if (L->stack_last - L->top <= ncl->p->maxstacksize) return 0;
+  if (L->hookmask & LUA_MASKCALL) return 0;
+  ci = zz_magic_frame(L, func, nresults, ncl->p);
+  if (zz_unlikely(f(L, ncl) == ZZ_MAGIC_TAILCALL))
+    zz_finish_tailcall(L, ci);
+  return 1;
+}
+
+
+/*
+** Can an OP_TAILCALL to 'func' reuse the current frame? We only do this for
+** functions that luaD_runmagic knows how to start, the ones with a magic
+** implementation (vararg or not). If there is a call hook we use the regular
+** call instead, so the hook sees the same events as before.
+*/
+static inline int zz_can_tailcall_magic(lua_State *L, StkId func) {
+  Proto *p;
+  if (!ttisLclosure(func)) return 0;
+  p = clLvalue(func)->p;
+  return p->magic_implementation != NULL && !(L->hookmask & LUA_MASKCALL);
+}
@@ -0,0 +1,78 @@
+/*
+** main() for standalone executables (luaot --executable). Running the
+** executable is like running "lua script.lua args...", where the script is
+** the module ZZ_MAIN_MODULE and all the compiled modules are in
+** package.preload. Most of this is copied from lua.c.
+*/
+
+static const char *zz_progname = "lua";
+
+static void zz_message (const char *pname, const char *msg) {
+    if (pname) lua_writestringerror("%s: ", pname);
+    lua_writestringerror("%s\n", msg);
+}
+
+static int zz_msghandler (lua_State *L) {
+    const char *msg = lua_tostring(L, 1);
+    if (msg == NULL) {  /* is error object not a string? */
+        if (luaL_callmeta(L, 1, "__tostring") &&  /* does it have a metamethod */
+            lua_type(L, -1) == LUA_TSTRING)  /* that produces a string? */
+            return 1;  /* that is the message */
+        else
+            msg = lua_pushfstring(L, "(error object is a %s value)",
+                                     luaL_typename(L, 1));
+    }
+    luaL_traceback(L, L, msg, 1);  /* append a standard traceback */
+    return 1;  /* return the traceback */
+}
+
+static int zz_pmain (lua_State *L) {
+    int argc = (int)lua_tointeger(L, 1);
+    char **argv = (char **)lua_touserdata(L, 2);
+    int narg = (argc > 0 ? argc - 1 : 0);  /* argc is 0 if there is no argv[0] */
+    luaL_checkversion(L);
+    luaL_openlibs(L);
+    zz_preload_modules(L, zz_modules);
+
+    /* global 'arg' table, with the program name at index 0 */
+    lua_createtable(L, narg, 1);
+    for (int i = 0; i < argc; i++) {
+        lua_pushstring(L, argv[i]);
+        lua_rawseti(L, -2, i);
+    }
+    lua_setglobal(L, "arg");
+
+    /* the main module gets the arguments as '...' */
+    int base = lua_gettop(L) + 1;
+    lua_pushcfunction(L, zz_msghandler);
+    lua_pushcfunction(L, ZZ_MAIN_MODULE);
+    for (int i = 1; i < argc; i++) {
+        lua_pushstring(L, argv[i]);
+    }
+    if (lua_pcall(L, narg, 0, base) != LUA_OK) {
+        zz_message(zz_progname, lua_tostring(L, -1));
+        return 0;
+    }
+    lua_pushboolean(L, 1);  /* signal no errors */
+    return 1;
+}
+
+int main (int argc, char **argv) {
+    int status, result;
+    if (argv[0] && argv[0][0]) zz_progname = argv[0];
+    lua_State *L = luaL_newstate();  /* create state */
+    if (L == NULL) {
+        zz_message(argv[0], "cannot create state: not enough memory");
+        return EXIT_FAILURE;
+    }
+    lua_pushcfunction(L, &zz_pmain);  /* to call 'zz_pmain' in protected mode */
+    lua_pushinteger(L, argc);  /* 1st argument */
+    lua_pushlightuserdata(L, argv); /* 2nd argument */
+    status = lua_pcall(L, 2, 1, 0);  /* do the call */
+    result = lua_toboolean(L, -1);  /* get result */
+    if (status != LUA_OK) {
+        zz_message(zz_progname, lua_tostring(L, -1));
+    }
+    lua_close(L);
+    return (result && status == LUA_OK) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
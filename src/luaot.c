@@ -13,6 +13,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,19 +27,48 @@
 
 #include "pretty_printer.h"
 
-static void PrintFunction(const Proto* f);
+static void PrintCode(const Proto* f);
+static void NumberFunctions(const Proto *f, const Proto *parent);
+static int FunctionId(const Proto *f);
+static void FindExports(const Proto *f);
+static int RealPc(int pc);
+static int FloatEntry(int pc);
+static int LoopExit(int pc);
+static int GuardedLoop(int pc);
+static int GuardedAccess(int pc);
 
 #define DEFAULT_PROGNAME "luaot"
+#define DEFAULT_SPLIT_THRESHOLD 2000
 
 // Program options:
 static const char* progname;        /* actual program name from argv[0] */
-static const char* input_filename;  /* path to input Lua module */
+static const char** input_filenames; /* paths to input Lua modules */
+static int ninputs;                  /* number of input Lua modules */
 static const char* output_filename; /* path to output C library module */
 static const char* module_name;     /* name of generated module (for luaopen_XXX) */
+static char** input_modnames;       /* name of each input module (for require) */
+static char** input_cnames;         /* same, with '_' instead of '.' */
 static int bytecode_literals;       /* Include the bytecodes as literals in the C code */
+static int hook_polling;            /* Where to check for line and count hooks */
+static int lazy_savedpc;            /* Only store savedpc when someone can look at it */
+static int print_stats;             /* Report the size of each function on stderr */
+static int executable;              /* Generate a main() that runs the first module */
+static int nshards;                 /* Split the functions into this many C files (0 = don't) */
+static int split_threshold;         /* Split functions with more instructions (0 = never) */
+static const char* profile_filename; /* Run-time profile from the VM (see lfunc.c) */
+static int print_cache_key;         /* Only print the cache key of the output */
+
+// Values for hook_polling
+#define HOOKS_EVERY_INSTRUCTION 0  /* Same as the interpreter (default) */
+#define HOOKS_BACKEDGES         1  /* Only at function entry and loop backedges */
+#define HOOKS_NONE              2  /* Never (--no-hooks) */
 
 // Global variables
 static int NFUNCTIONS = 0;  /* ID of magic functions */ 
+static int nprotos = 0;     /* number of functions in all the input modules */
+static const Proto **protos;   /* protos[id]: function with that magic ID */
+static const Proto **parents;  /* parents[id]: the enclosing function */
+static char *compiled;         /* compiled[id]: do we generate C code for it? */
 static PrettyPrinter pp;
 
 static void fatal(const char* message)
@@ -49,7 +79,7 @@ static void fatal(const char* message)
 
 static void usage()
 {
-  fprintf(stderr,"usage: %s INPUT -o OUTPUT\n", progname);
+  fprintf(stderr,"usage: %s INPUT... -o OUTPUT\n", progname);
   exit(EXIT_FAILURE);
 }
 
@@ -87,10 +117,19 @@ void split_ext(const char *path, char **noext_out, char **ext_out)
 static void doargs(int argc, char* argv[])
 {
   progname = DEFAULT_PROGNAME;
-  input_filename = NULL;
+  input_filenames = malloc(argc * sizeof(const char *));
+  if (!input_filenames) fatal("out of memory");
+  ninputs = 0;
   output_filename = NULL;
   module_name = NULL;
   bytecode_literals = 1;
+  hook_polling = HOOKS_EVERY_INSTRUCTION;
+  print_stats = 0;
+  executable = 0;
+  nshards = 0;
+  split_threshold = DEFAULT_SPLIT_THRESHOLD;
+  profile_filename = NULL;
+  print_cache_key = 0;
 
   if (argv[0] !=NULL && argv[0][0] != '\0') {
     progname=argv[0];
@@ -116,6 +155,45 @@ static void doargs(int argc, char* argv[])
         output_filename = argv[i];
       } else if (0 == strcmp(arg, "--no-constant-propagation")) {
         bytecode_literals = 0;
+      } else if (0 == strcmp(arg, "--backedge-hooks")) {
+        hook_polling = HOOKS_BACKEDGES;
+      } else if (0 == strcmp(arg, "--no-hooks")) {
+        hook_polling = HOOKS_NONE;
+      } else if (0 == strcmp(arg, "--stats")) {
+        print_stats = 1;
+      } else if (0 == strcmp(arg, "--executable")) {
+        executable = 1;
+      } else if (0 == strcmp(arg, "--cache-key")) {
+        print_cache_key = 1;
+      } else if (0 == strcmp(arg, "--split-threshold")) {
+        i += 1;
+        if (i >= argc ) {
+          fprintf(stderr, "%s: Missing argument for --split-threshold\n", progname);
+          usage();
+        }
+        split_threshold = atoi(argv[i]);
+        if (split_threshold < 0) {
+          fprintf(stderr, "%s: The split threshold must not be negative\n", progname);
+          usage();
+        }
+      } else if (0 == strcmp(arg, "--profile")) {
+        i += 1;
+        if (i >= argc ) {
+          fprintf(stderr, "%s: Missing argument for --profile\n", progname);
+          usage();
+        }
+        profile_filename = argv[i];
+      } else if (0 == strcmp(arg, "--shards")) {
+        i += 1;
+        if (i >= argc ) {
+          fprintf(stderr, "%s: Missing argument for --shards\n", progname);
+          usage();
+        }
+        nshards = atoi(argv[i]);
+        if (nshards < 1) {
+          fprintf(stderr, "%s: The number of shards must be a positive integer\n", progname);
+          usage();
+        }
       } else {
         fprintf(stderr,"%s: Unrecognized option %s\n", progname, arg);
         usage();
@@ -123,17 +201,14 @@ static void doargs(int argc, char* argv[])
 
     } else {
 
-      if (npos == 0) {
-        input_filename = arg;
-      } else {
-        fprintf(stderr,"%s: Too many positional parameters\n", progname);
-        usage();
-      }
-
+      input_filenames[ninputs++] = arg;
       npos++;
     }
   }
 
+  // Without the literals we fetch the instructions through savedpc.
+  lazy_savedpc = bytecode_literals;
+
   if (npos < 1) {
     fprintf(stderr, "%s: Too few positional parameters\n", progname);
     usage();
@@ -144,22 +219,25 @@ static void doargs(int argc, char* argv[])
     usage();
   }
 
-  char * input_basename = NULL;
-  char * input_basename_noext = NULL;
-  char * input_basename_ext = NULL;
-
   char * output_basename = NULL;
   char * output_basename_noext = NULL;
   char * output_basename_ext = NULL;
 
-  input_basename = basename(input_filename);
-  output_basename = basename(output_filename);
-
-  split_ext(input_basename, &input_basename_noext, &input_basename_ext);
-  if (input_basename_ext == NULL || 0 != strcmp(input_basename_ext, "lua")) {
-    fatal("input file must have a .lua extension");
+  for (int m = 0; m < ninputs; m++) {
+    char * input_basename = basename(input_filenames[m]);
+    char * input_basename_noext = NULL;
+    char * input_basename_ext = NULL;
+    split_ext(input_basename, &input_basename_noext, &input_basename_ext);
+    if (input_basename_ext == NULL || 0 != strcmp(input_basename_ext, "lua")) {
+      fatal("input file must have a .lua extension");
+    }
+    free(input_basename);
+    free(input_basename_noext);
+    free(input_basename_ext);
   }
 
+  output_basename = basename(output_filename);
+
   split_ext(output_basename, &output_basename_noext, &output_basename_ext);
   if (output_basename_ext == NULL || 0 != strcmp(output_basename_ext, "c")) {
     fatal("output file must have a .c extension");
@@ -173,80 +251,596 @@ static void doargs(int argc, char* argv[])
     }
   }
 
-  free(input_basename);
-  free(input_basename_noext);
-  free(input_basename_ext);
-
   free(output_basename);
   free(output_basename_noext);
   free(output_basename_ext);
+
+  input_modnames = malloc(ninputs * sizeof(char *));
+  input_cnames = malloc(ninputs * sizeof(char *));
+  if (!input_modnames || !input_cnames) fatal("out of memory");
+
+  if (ninputs == 1 && !executable) {
+    // The module is named after the output file, as always
+    input_modnames[0] = strdup(module_name);
+    input_cnames[0] = strdup(module_name);
+    return;
+  }
+
+  // Otherwise, each module is named after its path, the same way that
+  // 'require' would find it: "foo/bar.lua" is the module "foo.bar".
+  for (int m = 0; m < ninputs; m++) {
+    const char *path = input_filenames[m];
+    while (path[0] == '.' && path[1] == '/') path += 2;
+
+    char *name = strdup(path);
+    name[strlen(name) - 4] = '\0'; /* remove the .lua */
+    char *cname = strdup(name);
+    for (char *s = name, *c = cname; *s != '\0'; s++, c++) {
+      if (*s == '/') {
+        *s = '.';
+        *c = '_';
+      } else if (! (isalnum(*s) || *s == '_')) {
+        fatal("the name of an input module contains invalid characters (only letters, numbers, underscores and directory separators are allowed).");
+      }
+    }
+
+    // (An executable does not have a luaopen_ function of its own)
+    if (!executable && 0 == strcmp(cname, module_name)) {
+      fatal("the output file must not have the same name as one of the input modules");
+    }
+    for (int m2 = 0; m2 < m; m2++) {
+      if (0 == strcmp(cname, input_cnames[m2])) {
+        fatal("two input modules have the same name");
+      }
+    }
+
+    input_modnames[m] = name;
+    input_cnames[m] = cname;
+  }
 }
 
 #define toproto(L,i) getproto(L->top+(i))
 
+// Hash of the contents of the input file (64-bit FNV-1a). The searcher for
+// compiled modules uses this to check that the module is up to date, so this
+// must compute the same value as 'sourcehash' in loadlib.c.
+static lua_Unsigned SourceHash(const char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  if (!f) fatal("could not open input file");
+  lua_Unsigned h = (lua_Unsigned)0xcbf29ce484222325u;
+  int c;
+  while ((c = getc(f)) != EOF) {
+    h ^= (lua_Unsigned)c;
+    h *= (lua_Unsigned)0x100000001b3u;
+  }
+  if (ferror(f)) fatal("could not read input file");
+  fclose(f);
+  return h;
+}
+
+/*
+** Cache keys
+** ==========
+**
+** With --cache-key we only print a hash of everything that the output depends
+** on: the bytecode of each module (the dump that we embed, with the constants
+** and the debug information), the hash of its source file that we embed for
+** the searcher, the options that change the generated code, the profile, and
+** luaot itself (its program and the C files that the output includes). The
+** tiered compiler (ltier.c) and the Makefile of experiments/configure.py name
+** the libraries in their caches after this key, so that they only compile a
+** module again when its bytecode or the compiler changed.
+*/
+
+static void HashBytes(lua_Unsigned *h, const void *p, size_t size)
+{
+  const unsigned char *bytes = p;
+  for (size_t i = 0; i < size; i++) {
+    *h ^= (lua_Unsigned)bytes[i];
+    *h *= (lua_Unsigned)0x100000001b3u;
+  }
+}
+
+static void HashString(lua_Unsigned *h, const char *s)
+{
+  HashBytes(h, s, strlen(s) + 1); /* (with the '\0', to separate strings) */
+}
+
+// Missing files count as empty, so that luaot-generated-main.c is optional
+static void HashFile(lua_Unsigned *h, const char *path)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f) return;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    HashBytes(h, buf, n);
+  }
+  if (ferror(f)) fatal("could not read a file for the cache key");
+  fclose(f);
+}
+
+// lua_Writer that adds the bytes of the dump to the hash
+static int HashDump(lua_State *L, const void *p, size_t size, void *ud)
+{
+  (void) L;
+  HashBytes(ud, p, size);
+  return 0;
+}
+
+// The main functions of the modules are at the bottom of the stack
+static lua_Unsigned CacheKey(lua_State *L)
+{
+  lua_Unsigned h = (lua_Unsigned)0xcbf29ce484222325u;
+
+  // A luaot in the PATH only counts by its name, like in ltier.c
+  char path[4096];
+  if (strchr(progname, '/') && realpath(progname, path)) {
+    HashFile(&h, path);
+    char *dir_end = strrchr(path, '/') + 1;
+    static const char *const includes[] = {
+      "luaot-generated-header.c", "luaot-generated-footer.c",
+      "luaot-generated-main.c", NULL
+    };
+    for (int i = 0; includes[i]; i++) {
+      if (dir_end - path + strlen(includes[i]) >= sizeof(path))
+        fatal("luaot path is too long");
+      strcpy(dir_end, includes[i]);
+      HashFile(&h, path);
+    }
+  } else {
+    HashString(&h, progname);
+  }
+
+  char options[256];
+  snprintf(options, sizeof(options), "%d %d %d %d %d", bytecode_literals,
+           hook_polling, executable, nshards, split_threshold);
+  HashString(&h, options);
+  HashString(&h, module_name);
+  for (int m = 0; m < ninputs; m++) {
+    HashString(&h, input_modnames[m]);
+    lua_Unsigned source = SourceHash(input_filenames[m]);
+    HashBytes(&h, &source, sizeof(source));
+    lua_pushvalue(L, m + 1);
+    lua_dump(L, HashDump, &h, 0);
+    lua_pop(L, 1);
+  }
+  if (profile_filename) {
+    FILE *f = fopen(profile_filename, "rb");
+    if (!f) fatal("could not open profile file");
+    fclose(f);
+    HashFile(&h, profile_filename);
+  }
+  return h;
+}
+
+/*
+** Profiles
+** ========
+**
+** A VM built with LUAOT_PROFILE writes a profile of each function that ran
+** (see lfunc.c). We match the records to our functions by source name, first
+** and last line, number of instructions and a hash of the code, and add them
+** up. With a profile for a module, we leave the functions that never ran to
+** the interpreter, guard the arithmetic on the operand types that were seen,
+** and tell the C compiler which tests always went the same way.
+**
+** Functions with the same code on the same lines still have the same key, so
+** we cannot tell which one a record is for. Those functions share the sum of
+** their records, which is the same as if they were a single function.
+*/
+
+typedef struct {
+  unsigned long ncalls;
+  unsigned long *trips;  /* trips[pc]: times the backward jump at pc jumped */
+  unsigned char *seen;   /* seen[pc]: ZZ_SEEN_* bits, NULL if no record */
+} FunctionProfile;
+
+static FunctionProfile *fprofiles;  /* fprofiles[id], NULL without --profile */
+
+// The VM writes the chunkname, and "@./foo.lua" is the same as "foo.lua"
+static const char *SourceKey(const char *source)
+{
+  if (source[0] == '@') source++;
+  while (source[0] == '.' && source[1] == '/') source += 2;
+  return source;
+}
+
+// Must compute the same value as 'codehash' in lfunc.c
+static unsigned CodeHash(const Proto *p)
+{
+  unsigned h = 2166136261u;
+  for (int pc = 0; pc < p->sizecode; pc++) {
+    for (int b = 0; b < 32; b += 8) {
+      h ^= (p->code[pc] >> b) & 0xff;
+      h *= 16777619u;
+    }
+  }
+  return h & 0xffffffffu;
+}
+
+static int SameProfileKey(const Proto *p, const Proto *q)
+{
+  return p->linedefined == q->linedefined &&
+         p->lastlinedefined == q->lastlinedefined &&
+         p->sizecode == q->sizecode && p->source && q->source &&
+         0 == strcmp(SourceKey(getstr(p->source)), SourceKey(getstr(q->source))) &&
+         CodeHash(p) == CodeHash(q);
+}
+
+static FunctionProfile *FindProfile(int linedefined, int lastlinedefined,
+                                    int sizecode, unsigned hash, const char *source)
+{
+  for (int id = 0; id < nprotos; id++) {
+    const Proto *p = protos[id];
+    if (p->linedefined == linedefined && p->lastlinedefined == lastlinedefined &&
+        p->sizecode == sizecode && p->source &&
+        0 == strcmp(SourceKey(getstr(p->source)), SourceKey(source)) &&
+        CodeHash(p) == hash) {
+      FunctionProfile *prof = &fprofiles[id];
+      if (!prof->seen) {
+        prof->trips = calloc(sizecode, sizeof(unsigned long));
+        prof->seen = calloc(sizecode, 1);
+        if (!prof->trips || !prof->seen) fatal("out of memory");
+      }
+      return prof; /* (the first of the functions with this key) */
+    }
+  }
+  return NULL; /* (a module that we are not compiling, or an old profile) */
+}
+
+static void LoadProfile(const int *first_ids)
+{
+  FILE *f = fopen(profile_filename, "r");
+  if (!f) fatal("could not open profile file");
+  fprofiles = calloc(nprotos, sizeof(FunctionProfile));
+  if (!fprofiles) fatal("out of memory");
+
+  char line[4096];
+  FunctionProfile *prof = NULL;
+  int sizecode = 0;
+  while (fgets(line, sizeof(line), f)) {
+    int linedefined, lastlinedefined, pc, seen, pos;
+    unsigned hash;
+    unsigned long n;
+    if (sscanf(line, "function %d %d %d %u %lu %n", &linedefined, &lastlinedefined,
+               &sizecode, &hash, &n, &pos) == 5) {
+      line[strcspn(line, "\n")] = '\0';
+      prof = FindProfile(linedefined, lastlinedefined, sizecode, hash, line + pos);
+      if (prof) prof->ncalls += n;
+    } else if (sscanf(line, "pc %d %lu %d", &pc, &n, &seen) == 3) {
+      if (prof && 0 <= pc && pc < sizecode) {
+        prof->trips[pc] += n;
+        prof->seen[pc] |= seen;
+      }
+    } else if (0 == strcmp(line, "end\n")) {
+      prof = NULL;
+    } else {
+      fatal("invalid profile file");
+    }
+  }
+  if (ferror(f)) fatal("could not read profile file");
+  fclose(f);
+
+  // FindProfile put the records of ambiguous functions in the first of them
+  for (int id = 0; id < nprotos; id++) {
+    for (int other = 0; other < id; other++) {
+      if (SameProfileKey(protos[other], protos[id])) {
+        fprofiles[id] = fprofiles[other];
+        break;
+      }
+    }
+  }
+
+  // Modules without any record in the profile are compiled as usual
+  for (int m = 0; m < ninputs; m++) {
+    int first = first_ids[m];
+    int last = (m + 1 < ninputs ? first_ids[m+1] : nprotos);
+    int profiled = 0;
+    for (int id = first; id < last; id++) {
+      if (fprofiles[id].seen) profiled = 1;
+    }
+    if (!profiled) continue;
+    for (int id = first; id < last; id++) {
+      const FunctionProfile *prof = &fprofiles[id];
+      compiled[id] = (prof->ncalls > 0);
+      if (!print_stats) continue;
+      if (!compiled[id]) {
+        fprintf(stderr, "%s: function <%s:%d>: not compiled, it did not run\n",
+                progname, getstr(protos[id]->source), protos[id]->linedefined);
+      } else {
+        unsigned long trips = 0;
+        for (int pc = 0; pc < protos[id]->sizecode; pc++) trips += prof->trips[pc];
+        fprintf(stderr, "%s: function <%s:%d>: %lu calls, %lu loop iterations\n",
+                progname, getstr(protos[id]->source), protos[id]->linedefined,
+                prof->ncalls, trips);
+      }
+    }
+  }
+}
+
+// The ZZ_SEEN_* bits in the profile for the instruction at pc of the function
+// that we are compiling (0 if we don't know anything).
+static int ProfileSeen(int pc)
+{
+  if (!fprofiles || !fprofiles[NFUNCTIONS].seen) return 0;
+  return fprofiles[NFUNCTIONS].seen[RealPc(pc)];
+}
+
+// lua_Writer that prints the bytes of the dump as a C array initializer.
+static int WriteBytes(lua_State *L, const void *p, size_t size, void *ud)
+{
+  int *column = ud;
+  const unsigned char *bytes = p;
+  (void) L;
+  for (size_t i = 0; i < size; i++) {
+    PP_write(&pp, "%3d, ", bytes[i]);
+    if (++*column >= 16) {
+      *column = 0;
+      PP_end_line(&pp);
+      PP_begin_line(&pp);
+    }
+  }
+  return 0;
+}
+
+// So that any function can call any other directly
+static void PrintPrototypes()
+{
+  for (int id = 0; id < nprotos; id++) {
+    if (!compiled[id]) continue;
+    PP_writeln(&pp, "ZZ_FUNC int zz_magic_function_%d (lua_State *L, LClosure *cl);", id);
+  }
+  PP_writeln(&pp, "");
+}
+
+// Instructions of a function that we generate code for
+static int CodeSize(int id)
+{
+  return (compiled[id] ? protos[id]->sizecode : 0);
+}
+
+// Output files are written to "FILE.tmp" first, and only replace FILE if
+// they are different. Since the output does not change unless the Lua code
+// does, make (or the .mk file of --shards) does not recompile the shards
+// whose functions are the same as before.
+static FILE *OpenOutput(const char *path)
+{
+  char tmp[4096];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+    fatal("output file name is too long");
+  FILE *f = fopen(tmp, "w");
+  if (!f) fatal("could not open output file for writing");
+  return f;
+}
+
+static int SameContents(const char *path1, const char *path2)
+{
+  FILE *f1 = fopen(path1, "rb");
+  FILE *f2 = fopen(path2, "rb");
+  int same = (f1 && f2);
+  while (same) {
+    int c = getc(f1);
+    same = (c == getc(f2));
+    if (c == EOF) break;
+  }
+  if (f1) fclose(f1);
+  if (f2) fclose(f2);
+  return same;
+}
+
+static void CloseOutput(FILE *f, const char *path)
+{
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (ferror(f) | fclose(f)) fatal("could not write output file");
+  if (SameContents(tmp, path)) {
+    remove(tmp);
+  } else if (rename(tmp, path) != 0) {
+    fatal("could not write output file");
+  }
+}
+
+// With --shards, "foo.c" has everything except the functions, which go to
+// "foo_shard_0.c", "foo_shard_1.c", etc.
+static const char *ShardFilename(int shard)
+{
+  static char buf[4096];
+  int n = (int) strlen(output_filename) - 2; /* without the .c */
+  if (snprintf(buf, sizeof(buf), "%.*s_shard_%d.c", n, output_filename, shard)
+      >= (int) sizeof(buf))
+    fatal("output file name is too long");
+  return buf;
+}
+
+// A Makefile fragment ("foo.mk") that compiles the shards and links them
+// into foo.so. It can be run on its own (make -j -f foo.mk) or included by
+// another Makefile.
+static void PrintShardMakefile()
+{
+  char path[4096];
+  int n = (int) strlen(output_filename) - 2; /* without the .c */
+  if (snprintf(path, sizeof(path), "%.*s.mk", n, output_filename) >= (int) sizeof(path))
+    fatal("output file name is too long");
+  FILE *f = OpenOutput(path);
+
+  const char *m = module_name;
+  fprintf(f, "# Generated by luaot. Compiles the shards of %s.c in parallel and\n", m);
+  fprintf(f, "# links them into %s.so: make -j -f %s.mk\n", m, m);
+  fprintf(f, "# Set LUAOT_INCDIR to the directory with luaot-generated-header.c.\n\n");
+
+  fprintf(f, "%s_DIR := $(dir $(lastword $(MAKEFILE_LIST)))\n", m);
+  fprintf(f, "%s_SRC := $(addprefix $(%s_DIR),%s.c", m, m, m);
+  for (int shard = 0; shard < nshards; shard++) {
+    fprintf(f, " %s_shard_%d.c", m, shard);
+  }
+  fprintf(f, ")\n");
+  fprintf(f, "%s_OBJ := $(%s_SRC:.c=.o)\n", m, m);
+  fprintf(f, "%s_SO := $(%s_DIR)%s.so\n\n", m, m, m);
+
+  char incdir[4096];
+  if (strchr(progname, '/') && realpath(progname, incdir)) {
+    *strrchr(incdir, '/') = '\0';
+    fprintf(f, "LUAOT_INCDIR ?= %s\n", incdir);
+  }
+  fprintf(f, "LUAOT_CC ?= gcc -std=gnu99\n");
+  fprintf(f, "LUAOT_CFLAGS ?= -O2 -fPIC\n\n");
+
+  fprintf(f, "$(%s_SO): $(%s_OBJ)\n", m, m);
+  fprintf(f, "\t$(LUAOT_CC) -shared -o $@ $(%s_OBJ)\n\n", m);
+  fprintf(f, "$(%s_OBJ): %%.o: %%.c\n", m);
+  fprintf(f, "\t$(LUAOT_CC) $(LUAOT_CFLAGS) -I$(LUAOT_INCDIR) -c $< -o $@\n");
+
+  CloseOutput(f, path);
+}
+
 static int pmain(lua_State* L)
 {
-  if (luaL_loadfile(L, input_filename) != LUA_OK) fatal(lua_tostring(L,-1));
+  const Proto **mains = malloc(ninputs * sizeof(const Proto *));
+  int *first_ids = malloc(ninputs * sizeof(int));
+  if (!mains || !first_ids) fatal("out of memory");
+
+  // Keep all the chunks on the stack, since we need them until the end.
+  luaL_checkstack(L, ninputs, "too many input files");
+  for (int m = 0; m < ninputs; m++) {
+    if (luaL_loadfile(L, input_filenames[m]) != LUA_OK) fatal(lua_tostring(L,-1));
+    mains[m] = toproto(L, -1);
+  }
 
-  const Proto* f = toproto(L, -1);
+  if (print_cache_key) {
+    printf("%016llx\n", (unsigned long long)CacheKey(L));
+    free(mains);
+    free(first_ids);
+    return 0;
+  }
+
+  for (int m = 0; m < ninputs; m++) {
+    first_ids[m] = nprotos;
+    NumberFunctions(mains[m], NULL);
+  }
+  compiled = malloc(nprotos);
+  if (!compiled) fatal("out of memory");
+  memset(compiled, 1, nprotos);
+  if (profile_filename) LoadProfile(first_ids);
+  for (int m = 0; m < ninputs; m++) {
+    FindExports(mains[m]);
+  }
 
+  FILE *registry = pp.outfile;
+  if (nshards > 0) {
+    PP_writeln(&pp, "#define ZZ_SHARDED");
+  }
   PP_writeln(&pp, "#include \"luaot-generated-header.c\"");
   PP_writeln(&pp, "");
+  PrintPrototypes();
 
-  {
+  if (nshards > 0) {
+    // Split the functions into groups of about the same number of
+    // instructions, keeping the functions of each group together.
+    long total = 0;
+    for (int id = 0; id < nprotos; id++) total += CodeSize(id);
+
+    NFUNCTIONS = 0;
+    long done = 0;
+    for (int shard = 0; shard < nshards; shard++) {
+      long budget = (total - done) / (nshards - shard);
+      long size = 0;
+      FILE *f = OpenOutput(ShardFilename(shard));
+      PP_init(&pp, f);
+      PP_writeln(&pp, "#define ZZ_SHARDED");
+      PP_writeln(&pp, "#include \"luaot-generated-header.c\"");
+      PP_writeln(&pp, "");
+      PrintPrototypes();
+      while (NFUNCTIONS < nprotos &&
+             (shard == nshards - 1 || size == 0 ||
+              size + CodeSize(NFUNCTIONS) <= budget)) {
+        size += CodeSize(NFUNCTIONS);
+        if (compiled[NFUNCTIONS]) PrintCode(protos[NFUNCTIONS]);
+        NFUNCTIONS++;
+      }
+      done += size;
+      CloseOutput(f, ShardFilename(shard));
+    }
+    PP_init(&pp, registry);
+    PrintShardMakefile();
+  } else {
     // Generated C implementations
     NFUNCTIONS = 0;
-    PrintFunction(f);
+    while (NFUNCTIONS < nprotos) {
+      if (compiled[NFUNCTIONS]) PrintCode(protos[NFUNCTIONS]);
+      NFUNCTIONS++;
+    }
   }
 
   {
     PP_writeln(&pp, "ZZ_MAGIC_FUNC zz_magic_functions[%d] = {", NFUNCTIONS);
     for (int i=0; i < NFUNCTIONS; i++) {
-      PP_writeln(&pp, "  zz_magic_function_%d,", i);
+      if (compiled[i])
+        PP_writeln(&pp, "  zz_magic_function_%d,", i);
+      else
+        PP_writeln(&pp, "  NULL,  /* left to the interpreter */");
     }
     PP_writeln(&pp, "};");
     PP_writeln(&pp, "");
   }
 
-  {
-    // The original Lua code
+  for (int m = 0; m < ninputs; m++) {
+    // The bytecode of the original Lua code
     //
     // We need this right now because our code works by taking an existing
     // Proto* and patching it by setting the magic_implementation field.
     //
-    // Right now I am serializing the Lua source code (as a char array because
-    // trying to serialize as a string blew the C99 maximum string length).
-    // I would prefer to only serialize as bytecode or perhaps even only serialize 
-    // the parts of the Proto* that we need but I couldn't figure out how to do 
-    // this yet.
-
-    FILE *infile = fopen(input_filename, "r");
-    if (!infile) fatal("could not open input file");
+    // We serialize the same Proto* that we compiled (with lua_dump, including
+    // the debug information) so that loading the module does not need to run
+    // the parser. This is a char array because trying to serialize as a string
+    // blew the C99 maximum string length.
 
-    PP_writeln(&pp, "static const char ZZ_ORIGINAL_SOURCE_CODE[] = {"); PP_indent(&pp);
+    PP_writeln(&pp, "static const unsigned char ZZ_BYTECODE_%d[] = {", m); PP_indent(&pp);
     PP_begin_line(&pp);
-    {int c, i=0; while (c = fgetc(infile), c != EOF) {
-      PP_write(&pp, "%3d, ", c);
-      if (++i >= 16) {
-        i = 0;
-        PP_end_line(&pp);
-        PP_begin_line(&pp);
-      }
-    }}
-    PP_write(&pp, "%3d,", 0);
+    int column = 0;
+    lua_pushvalue(L, m + 1);
+    lua_dump(L, WriteBytes, &column, 0);
+    lua_pop(L, 1);
     PP_end_line(&pp);
     PP_dedent(&pp); PP_writeln(&pp, "};");
     PP_writeln(&pp, "");
+  }
 
-    fclose(infile);
+  PP_writeln(&pp, "#include \"luaot-generated-footer.c\"");
+  PP_writeln(&pp, "");
 
+  for (int m = 0; m < ninputs; m++) {
+    PP_writeln(&pp, "ZZ_DEFINE_MODULE(%s, \"%s\", ZZ_BYTECODE_%d, %d, (lua_Integer)0x%016llxu)",
+               input_cnames[m], input_modnames[m],
+               m, first_ids[m],
+               (unsigned long long)SourceHash(input_filenames[m]));
   }
 
-  PP_writeln(&pp, "#define ZZ_LUAOPEN_NAME luaopen_%s", module_name);
-  PP_writeln(&pp, "");
+  if (ninputs > 1 || executable) {
+    PP_writeln(&pp, "");
+    PP_writeln(&pp, "static const luaL_Reg zz_modules[] = {"); PP_indent(&pp);
+    for (int m = 0; m < ninputs; m++) {
+      PP_writeln(&pp, "{\"%s\", luaopen_%s},", input_modnames[m], input_cnames[m]);
+    }
+    PP_writeln(&pp, "{NULL, NULL}");
+    PP_dedent(&pp); PP_writeln(&pp, "};");
+    PP_writeln(&pp, "");
+  }
 
-  PP_writeln(&pp, "#include \"luaot-generated-footer.c\"");
+  if (executable) {
+    PP_writeln(&pp, "#define ZZ_MAIN_MODULE luaopen_%s", input_cnames[0]);
+    PP_writeln(&pp, "#include \"luaot-generated-main.c\"");
+  } else if (ninputs > 1) {
+    PP_writeln(&pp, "int luaopen_%s (lua_State *L) {", module_name); PP_indent(&pp);
+    PP_writeln(&pp, "zz_preload_modules(L, zz_modules);");
+    PP_writeln(&pp, "lua_pushboolean(L, 1);");
+    PP_writeln(&pp, "return 1;");
+    PP_dedent(&pp); PP_writeln(&pp, "}");
+  }
 
+  free(mains);
+  free(first_ids);
   return 0;
 }
 
@@ -254,20 +848,19 @@ int main(int argc, char* argv[])
 {
   doargs(argc,argv);
 
-  FILE *outfile = fopen(output_filename, "w");
-  if (!outfile) {
-    fatal("could not open output file for writing");
+  FILE *outfile = NULL;
+  if (!print_cache_key) {
+    outfile = OpenOutput(output_filename);
+    PP_init(&pp, outfile);
   }
 
-  PP_init(&pp, outfile);
-
   lua_State* L = luaL_newstate();
   if (L==NULL) fatal("cannot create state: not enough memory");
   lua_pushcfunction(L, &pmain);
   if (lua_pcall(L,0,0,0)!=LUA_OK) fatal(lua_tostring(L,-1));
   lua_close(L);
 
-  fclose(outfile);
+  if (outfile) CloseOutput(outfile, output_filename);
 
   return EXIT_SUCCESS;
 }
@@ -450,7 +1043,7 @@ static void PrintOpcodeComment(const Proto *f, int pc)
       break;
 
     case OP_CLOSURE:
-      PP_write(&pp, "\t; %p",VOID(f->p[bx]));
+      PP_write(&pp, "\t; function %d",FunctionId(f->p[bx]));
       break;
 
     case OP_SETLIST:
@@ -468,599 +1061,2951 @@ static void PrintOpcodeComment(const Proto *f, int pc)
   PP_end_line(&pp);
 }
 
+/*
+** Type inference
+** ==============
+**
+** A forward dataflow analysis over the bytecode of a single function. For each
+** instruction we compute the set of types that each register may hold right
+** before that instruction executes. The code generator uses this to emit only
+** the integer or only the float version of an arithmetic operation when the
+** types of its operands are known at compile time.
+**
+** The analysis assumes that nobody uses the debug library to change the type
+** of a local variable behind our back.
+*/
 
-static void PrintCode(const Proto* f)
+typedef unsigned char TypeSet;
+
+#define T_INTEGER  1
+#define T_FLOAT    2
+#define T_OTHER    4  /* anything that is not a number */
+#define T_NUMBER   (T_INTEGER | T_FLOAT)
+#define T_ANY      (T_NUMBER | T_OTHER)
+
+typedef struct {
+  const Proto *f;
+  int nregs;
+  char *reached;    /* reached[pc]: is the instruction reachable? */
+  char *captured;   /* captured[r]: is the register an upvalue of a closure? */
+  TypeSet *types;   /* types[pc*nregs + r]: types of register r before pc */
+  char *live;       /* live[pc*nregs + r]: is r live before pc? */
+  int *range;       /* range[pc*nregs + r]: live range of r before pc */
+  int *def_range;   /* def_range[d]: live range of the assignment d */
+  TypeSet *unboxed; /* unboxed[w]: type of the C local for live range w (0 if none) */
+  int *nlocals;     /* nlocals[r]: number of unboxed live ranges of r */
+} TypeInfo;
+
+#define REGTYPES(ti,pc)  ((ti)->types + (pc) * (ti)->nregs)
+
+static TypeSet ConstantType(const Proto *f, int idx)
 {
-  const Instruction* code=f->code;
-  int nopcodes=f->sizecode;
-
-  PP_writeln(&pp, "// source = %s", getstr(f->source));
-  PP_writeln(&pp, "// linedefined = %d", f->linedefined);
-  PP_writeln(&pp, "// lastlinedefined = %d", f->lastlinedefined);
-  PP_writeln(&pp, "// what = %s", (f->linedefined == 0) ? "main" : "Lua");
-
-  PP_writeln(&pp, "static int zz_magic_function_%d (lua_State *L, LClosure *cl)", NFUNCTIONS);
-  PP_writeln(&pp, "{"); PP_indent(&pp);
-  PP_writeln(&pp,   "CallInfo *ci = L->ci;");
-  PP_writeln(&pp,   "TValue *k = cl->p->k;");
-  PP_writeln(&pp,   "StkId base = ci->u.l.base;");
-  PP_writeln(&pp,   "");
-  PP_writeln(&pp,   "// Avoid warnings if the function has few opcodes:");
-  PP_writeln(&pp,   "(void) ci;");
-  PP_writeln(&pp,   "(void) k;");
-  PP_writeln(&pp,   "(void) base;");
-  PP_writeln(&pp,   "");
-
-  for (int pc=0; pc<nopcodes; pc++) {
-    PrintOpcodeComment(f, pc);
-
-    Instruction i = code[pc];
-    OpCode o=GET_OPCODE(i);
-
-    PP_writeln(&pp, "label_%d: {", pc); PP_indent(&pp);
-
-    // vmfetch
-    if (bytecode_literals) {
-      PP_writeln(&pp, "Instruction i = 0x%08x;", i);
-      // PP_writeln(&pp, "assert(i == *ci->u.l.savedpc);");
-      PP_writeln(&pp, "ci->u.l.savedpc++;");
-    } else {
-      PP_writeln(&pp, "Instruction i = *(ci->u.l.savedpc++);");
-      // PP_writeln(&pp, "assert(i ==  0x%08x);", i);
-    }
-    PP_writeln(&pp, "if (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT))");
-    PP_writeln(&pp, "  Protect(luaG_traceexec(L));");
-    PP_writeln(&pp, "StkId ra = RA(i); /* WARNING: any stack reallocation invalidates 'ra' */");
-    PP_writeln(&pp, "lua_assert(base == ci->u.l.base);");
-    PP_writeln(&pp, "lua_assert(base <= L->top && L->top < L->stack + L->stacksize);");
-    PP_writeln(&pp, "");
-
-    switch (o) {
-
-      case OP_MOVE: {
-        PP_writeln(&pp, "setobjs2s(L, ra, RB(i));");
-      } break;
-
-      case OP_LOADK: {
-        PP_writeln(&pp, "TValue *rb = k + GETARG_Bx(i);");
-        PP_writeln(&pp, "setobj2s(L, ra, rb);");
-      } break;
-
-      case OP_LOADKX: {
-        assert(pc + 1 < nopcodes);
-        PP_writeln(&pp, "TValue *rb;");
-        PP_writeln(&pp, "lua_assert(GET_OPCODE(*ci->u.l.savedpc) == OP_EXTRAARG);");
-        PP_writeln(&pp, "rb = k + GETARG_Ax(*ci->u.l.savedpc++);");
-        PP_writeln(&pp, "setobj2s(L, ra, rb);");
-        PP_writeln(&pp, "goto label_%d;", pc+2);
-      } break;
-
-      case OP_LOADBOOL: {
-        PP_writeln(&pp, "setbvalue(ra, GETARG_B(i));");
-        PP_writeln(&pp, "if (GETARG_C(i)) { /* skip next instruction (if C) */");
-        PP_writeln(&pp, "  ci->u.l.savedpc++;");
-        PP_writeln(&pp, "  goto label_%d;", pc+2);
-        PP_writeln(&pp, "}");
-      } break;
-
-      case OP_LOADNIL: {
-        PP_writeln(&pp, "int b = GETARG_B(i);");
-        PP_writeln(&pp, "do {");
-        PP_writeln(&pp, "  setnilvalue(ra++);");
-        PP_writeln(&pp, "} while (b--);");
-      } break;
- 
-      case OP_GETUPVAL: {
-        PP_writeln(&pp, "int b = GETARG_B(i);");
-        PP_writeln(&pp, "setobj2s(L, ra, cl->upvals[b]->v);");
-      } break;
-     
-      case OP_GETTABUP: {
-        PP_writeln(&pp, "TValue *upval = cl->upvals[GETARG_B(i)]->v;");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "gettableProtected(L, upval, rc, ra);");
-      } break;
-
-      case OP_GETTABLE: {
-        PP_writeln(&pp, "StkId rb = RB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "gettableProtected(L, rb, rc, ra);");
-      } break;
-
-      case OP_SETTABUP: {
-        PP_writeln(&pp, "(void) ra;");
-        PP_writeln(&pp, "TValue *upval = cl->upvals[GETARG_A(i)]->v;");
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "settableProtected(L, upval, rb, rc);");
-      } break;
-
-      case OP_SETUPVAL: {
-        PP_writeln(&pp, "UpVal *uv = cl->upvals[GETARG_B(i)];");
-        PP_writeln(&pp, "setobj(L, uv->v, ra);");
-        PP_writeln(&pp, "luaC_upvalbarrier(L, uv);");
-      } break;
-
-      case OP_SETTABLE: {
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "settableProtected(L, ra, rb, rc);");
-      } break;
-
-      case OP_NEWTABLE: {
-        PP_writeln(&pp, "int b = GETARG_B(i);");
-        PP_writeln(&pp, "int c = GETARG_C(i);");
-        PP_writeln(&pp, "Table *t = luaH_new(L);");
-        PP_writeln(&pp, "sethvalue(L, ra, t);");
-        PP_writeln(&pp, "if (b != 0 || c != 0)");
-        PP_writeln(&pp, "  luaH_resize(L, t, luaO_fb2int(b), luaO_fb2int(c));");
-        PP_writeln(&pp, "checkGC(L, ra + 1);");
-      } break;
-
-      case OP_SELF: {
-        PP_writeln(&pp, "const TValue *aux;");
-        PP_writeln(&pp, "StkId rb = RB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "TString *key = tsvalue(rc);  /* key must be a string */");
-        PP_writeln(&pp, "setobjs2s(L, ra + 1, rb);");
-        PP_writeln(&pp, "if (luaV_fastget(L, rb, key, aux, luaH_getstr)) {");
-        PP_writeln(&pp, "  setobj2s(L, ra, aux);");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else Protect(luaV_finishget(L, rb, rc, ra, aux));");
-      } break;
-
-      case OP_ADD: {
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
-        PP_writeln(&pp, "if (ttisinteger(rb) && ttisinteger(rc)) {");
-        PP_writeln(&pp, "  lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);");
-        PP_writeln(&pp, "  setivalue(ra, intop(+, ib, ic));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
-        PP_writeln(&pp, "  setfltvalue(ra, luai_numadd(L, nb, nc));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_ADD)); }");
-      } break;
-
-      case OP_SUB: {
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
-        PP_writeln(&pp, "if (ttisinteger(rb) && ttisinteger(rc)) {");
-        PP_writeln(&pp, "  lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);");
-        PP_writeln(&pp, "  setivalue(ra, intop(-, ib, ic));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
-        PP_writeln(&pp, "  setfltvalue(ra, luai_numsub(L, nb, nc));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_SUB)); }");
-      } break;
-
-      case OP_MUL: {
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
-        PP_writeln(&pp, "if (ttisinteger(rb) && ttisinteger(rc)) {");
-        PP_writeln(&pp, "  lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);");
-        PP_writeln(&pp, "  setivalue(ra, intop(*, ib, ic));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
-        PP_writeln(&pp, "  setfltvalue(ra, luai_nummul(L, nb, nc));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_MUL)); }");
-      } break;
-
-      case OP_DIV: {
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
-        PP_writeln(&pp, "if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
-        PP_writeln(&pp, "  setfltvalue(ra, luai_numdiv(L, nb, nc));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_DIV)); }");
-      } break;
-
-      case OP_BAND: {
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "lua_Integer ib; lua_Integer ic;");
-        PP_writeln(&pp, "if (tointeger(rb, &ib) && tointeger(rc, &ic)) {");
-        PP_writeln(&pp, "  setivalue(ra, intop(&, ib, ic));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_BAND)); }");
-      } break;
-
-      case OP_BOR: {
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "lua_Integer ib; lua_Integer ic;");
-        PP_writeln(&pp, "if (tointeger(rb, &ib) && tointeger(rc, &ic)) {");
-        PP_writeln(&pp, "  setivalue(ra, intop(|, ib, ic));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_BOR)); }");
-      } break;
-
-      case OP_BXOR: {
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "lua_Integer ib; lua_Integer ic;");
-        PP_writeln(&pp, "if (tointeger(rb, &ib) && tointeger(rc, &ic)) {");
-        PP_writeln(&pp, "  setivalue(ra, intop(^, ib, ic));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_BXOR)); }");
-      } break;
-
-      case OP_SHL: {
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "lua_Integer ib; lua_Integer ic;");
-        PP_writeln(&pp, "if (tointeger(rb, &ib) && tointeger(rc, &ic)) {");
-        PP_writeln(&pp, "  setivalue(ra, luaV_shiftl(ib, ic));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_SHL)); }");
-      } break;
-
-      case OP_SHR: {
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "lua_Integer ib; lua_Integer ic;");
-        PP_writeln(&pp, "if (tointeger(rb, &ib) && tointeger(rc, &ic)) {");
-        PP_writeln(&pp, "  setivalue(ra, luaV_shiftl(ib, -ic));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_SHR)); }");
-      } break;
-
-      case OP_MOD: {
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
-        PP_writeln(&pp, "if (ttisinteger(rb) && ttisinteger(rc)) {");
-        PP_writeln(&pp, "  lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);");
-        PP_writeln(&pp, "  setivalue(ra, luaV_mod(L, ib, ic));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
-        PP_writeln(&pp, "  lua_Number m;");
-        PP_writeln(&pp, "  luai_nummod(L, nb, nc, m);");
-        PP_writeln(&pp, "  setfltvalue(ra, m);");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_MOD)); }");
-      } break;
-
-      case OP_IDIV: { /* floor division */
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
-        PP_writeln(&pp, "if (ttisinteger(rb) && ttisinteger(rc)) {");
-        PP_writeln(&pp, "  lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);");
-        PP_writeln(&pp, "  setivalue(ra, luaV_div(L, ib, ic));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
-        PP_writeln(&pp, "  setfltvalue(ra, luai_numidiv(L, nb, nc));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_IDIV)); }");
-      } break;
-
-      case OP_POW: {
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
-        PP_writeln(&pp, "if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
-        PP_writeln(&pp, "  setfltvalue(ra, luai_numpow(L, nb, nc));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else { Protect(luaT_trybinTM(L, rb, rc, ra, TM_POW)); }");
-      } break;
-
-      case OP_UNM: {
-        PP_writeln(&pp, "TValue *rb = RB(i);");
-        PP_writeln(&pp, "lua_Number nb;");
-        PP_writeln(&pp, "if (ttisinteger(rb)) {");
-        PP_writeln(&pp, "  lua_Integer ib = ivalue(rb);");
-        PP_writeln(&pp, "  setivalue(ra, intop(-, 0, ib));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else if (tonumber(rb, &nb)) {");
-        PP_writeln(&pp, "  setfltvalue(ra, luai_numunm(L, nb));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else {");
-        PP_writeln(&pp, "  Protect(luaT_trybinTM(L, rb, rb, ra, TM_UNM));");
-        PP_writeln(&pp, "}");
-      } break;
-
-      case OP_BNOT: {
-        PP_writeln(&pp, "TValue *rb = RB(i);");
-        PP_writeln(&pp, "lua_Integer ib;");
-        PP_writeln(&pp, "if (tointeger(rb, &ib)) {");
-        PP_writeln(&pp, "  setivalue(ra, intop(^, ~l_castS2U(0), ib));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else {");
-        PP_writeln(&pp, "  Protect(luaT_trybinTM(L, rb, rb, ra, TM_BNOT));");
-        PP_writeln(&pp, "}");
-      } break;
-
-      case OP_NOT: {
-        PP_writeln(&pp, "TValue *rb = RB(i);");
-        PP_writeln(&pp, "int res = l_isfalse(rb);  /* next assignment may change this value */");
-        PP_writeln(&pp, "setbvalue(ra, res);");
-      } break;
-
-      case OP_LEN: {
-        PP_writeln(&pp, "Protect(luaV_objlen(L, ra, RB(i)));");
-      } break;
-
-      case OP_CONCAT: {
-        PP_writeln(&pp, "int b = GETARG_B(i);");
-        PP_writeln(&pp, "int c = GETARG_C(i);");
-        PP_writeln(&pp, "StkId rb;");
-        PP_writeln(&pp, "L->top = base + c + 1;  /* mark the end of concat operands */");
-        PP_writeln(&pp, "Protect(luaV_concat(L, c - b + 1));");
-        PP_writeln(&pp, "ra = RA(i);  /* 'luaV_concat' may invoke TMs and move the stack */");
-        PP_writeln(&pp, "rb = base + b;");
-        PP_writeln(&pp, "setobjs2s(L, ra, rb);");
-        PP_writeln(&pp, "checkGC(L, (ra >= rb ? ra + 1 : rb));");
-        PP_writeln(&pp, "L->top = ci->top;  /* restore top */");
-      } break;
-
-      case OP_JMP: {
-        int target = pc + GETARG_sBx(i) + 1;
-        PP_writeln(&pp, "(void) ra;");
-        PP_writeln(&pp, "int a = GETARG_A(i);");
-        PP_writeln(&pp, "if (a != 0) luaF_close(L, ci->u.l.base + a - 1);");
-        PP_writeln(&pp, "ci->u.l.savedpc += GETARG_sBx(i);"); // (!)
-        PP_writeln(&pp, "goto label_%d;", target);
-      } break;
+  const TValue *o = &f->k[idx];
+  if (ttisinteger(o)) return T_INTEGER;
+  if (ttisfloat(o))   return T_FLOAT;
+  return T_OTHER;
+}
 
-      case OP_EQ: {
-        PP_writeln(&pp, "(void) ra;");
-        PP_writeln(&pp, "TValue *rb = RKB(i);");
-        PP_writeln(&pp, "TValue *rc = RKC(i);");
-        PP_writeln(&pp, "int cmp;");
-        PP_writeln(&pp, "Protect(cmp = luaV_equalobj(L, rb, rc));");
-        PP_writeln(&pp, "if (cmp != GETARG_A(i)) {");
-        PP_writeln(&pp, "  ci->u.l.savedpc++;\n");
-        PP_writeln(&pp, "  goto label_%d;", pc+2);
-        PP_writeln(&pp, "}");
-      } break;
-
-      case OP_LT: {
-        PP_writeln(&pp, "(void) ra;");
-        PP_writeln(&pp, "int cmp;");
-        PP_writeln(&pp, "Protect(cmp = luaV_lessthan(L, RKB(i), RKC(i)));");
-        PP_writeln(&pp, "if (cmp != GETARG_A(i)) {");
-        PP_writeln(&pp, "  ci->u.l.savedpc++;\n");
-        PP_writeln(&pp, "  goto label_%d;", pc+2);
-        PP_writeln(&pp, "}");
-      } break;
-
-      case OP_LE: {
-        PP_writeln(&pp, "(void) ra;");
-        PP_writeln(&pp, "int cmp;");
-        PP_writeln(&pp, "Protect(cmp = luaV_lessequal(L, RKB(i), RKC(i)));");
-        PP_writeln(&pp, "if (cmp != GETARG_A(i)) {");
-        PP_writeln(&pp, "  ci->u.l.savedpc++;\n");
-        PP_writeln(&pp, "  goto label_%d;", pc+2);
-        PP_writeln(&pp, "}");
-      } break;
-
-      case OP_TEST: {
-        PP_writeln(&pp, "if (GETARG_C(i) ? l_isfalse(ra) : !l_isfalse(ra)) {");
-        PP_writeln(&pp, "  ci->u.l.savedpc++;\n");
-        PP_writeln(&pp, "  goto label_%d;", pc+2);
-        PP_writeln(&pp, "}");
-      } break;
-
-      case OP_TESTSET: {
-        PP_writeln(&pp, "TValue *rb = RB(i);");
-        PP_writeln(&pp, "if (GETARG_C(i) ? l_isfalse(rb) : !l_isfalse(rb)) {");
-        PP_writeln(&pp, "  ci->u.l.savedpc++;\n");
-        PP_writeln(&pp, "  goto label_%d;", pc+2);
-        PP_writeln(&pp, "} else {");
-        PP_writeln(&pp, "  setobjs2s(L, ra, rb);");
-        PP_writeln(&pp, "}");
-      } break;
-
-      case OP_CALL: {
-        PP_writeln(&pp, "int b = GETARG_B(i);");
-        PP_writeln(&pp, "int nresults = GETARG_C(i) - 1;");
-        PP_writeln(&pp, "if (b != 0) L->top = ra+b;  /* else previous instruction set top */");
-        PP_writeln(&pp, "if (luaD_precall(L, ra, nresults)) {  /* C function? */");
-        PP_writeln(&pp, "  if (nresults >= 0)");
-        PP_writeln(&pp, "    L->top = ci->top;  /* adjust results */");
-        PP_writeln(&pp, "  Protect((void)0);  /* update 'base' */");
-        PP_writeln(&pp, "} else {  /* Lua function */");
-        PP_writeln(&pp, "  luaV_execute(L);");                       // (!)
-        PP_writeln(&pp, "  Protect((void)0);  /* update 'base' */"); // (!)
-        PP_writeln(&pp, "}");
-      } break;
-
-      case OP_TAILCALL: {
-        PP_writeln(&pp, "int b = GETARG_B(i);");
-        PP_writeln(&pp, "if (b != 0) L->top = ra+b;  /* else previous instruction set top */");
-        PP_writeln(&pp, "lua_assert(GETARG_C(i) - 1 == LUA_MULTRET);");
-        PP_writeln(&pp, "if (luaD_precall(L, ra, LUA_MULTRET)) {  /* C function? */");
-        PP_writeln(&pp, "  Protect((void)0);  /* update 'base' */");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else {");
-        PP_writeln(&pp, "  luaV_execute(L);");
-        PP_writeln(&pp, "  Protect((void)0);  /* update 'base' */");
-        PP_writeln(&pp, "}");
-
-        // I think the "tailcall a c function" path assumes that the next instruction
-        // is a return statement and that I can use this on the regular calls as well
-        // since we are throwing away the idea of tail calls anyway.
-        //
-        // But lets check that just in case
-        assert(pc+1 < nopcodes);
-        Instruction next = code[pc+1];
-        assert(GET_OPCODE(next) == OP_RETURN);
-        assert(GETARG_B(next) == 0);
-      } break;
-
-      case OP_RETURN: {
-        PP_writeln(&pp, "int b = GETARG_B(i);");
-        PP_writeln(&pp, "if (cl->p->sizep > 0) luaF_close(L, base);");
-        PP_writeln(&pp, "int ret = (b != 0 ? b - 1 : cast_int(L->top - ra));");
-        PP_writeln(&pp, "luaD_poscall(L, ci, ra, ret);");
-        PP_writeln(&pp, "return ret;");
-      } break;
-
-      case OP_FORLOOP: {
-        int target = pc + GETARG_sBx(i) + 1;
-        PP_writeln(&pp, "if (ttisinteger(ra)) {  /* integer loop? */");
-        PP_writeln(&pp, "  lua_Integer step = ivalue(ra + 2);");
-        PP_writeln(&pp, "  lua_Integer idx = intop(+, ivalue(ra), step); /* increment index */");
-        PP_writeln(&pp, "  lua_Integer limit = ivalue(ra + 1);");
-        PP_writeln(&pp, "  if ((0 < step) ? (idx <= limit) : (limit <= idx)) {");
-        PP_writeln(&pp, "    chgivalue(ra, idx);  /* update internal index... */");
-        PP_writeln(&pp, "    setivalue(ra + 3, idx);  /* ...and external index */");
-        PP_writeln(&pp, "    ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */");
-        PP_writeln(&pp, "    goto label_%d;  /* jump back */", target);
-        PP_writeln(&pp, "  }");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else {  /* floating loop */");
-        PP_writeln(&pp, "  lua_Number step = fltvalue(ra + 2);");
-        PP_writeln(&pp, "  lua_Number idx = luai_numadd(L, fltvalue(ra), step); /* inc. index */");
-        PP_writeln(&pp, "  lua_Number limit = fltvalue(ra + 1);");
-        PP_writeln(&pp, "  if (luai_numlt(0, step) ? luai_numle(idx, limit)");
-        PP_writeln(&pp, "                          : luai_numle(limit, idx)) {");
-        PP_writeln(&pp, "    chgfltvalue(ra, idx);  /* update internal index... */");
-        PP_writeln(&pp, "    setfltvalue(ra + 3, idx);  /* ...and external index */");
-        PP_writeln(&pp, "    ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */");
-        PP_writeln(&pp, "    goto label_%d;  /* jump back */", target);
-        PP_writeln(&pp, "  }");
-        PP_writeln(&pp, "}");
-      } break;
-
-      case OP_FORPREP: { 
-        int target = pc + GETARG_sBx(i) + 1;
-        PP_writeln(&pp, "TValue *init = ra;");
-        PP_writeln(&pp, "TValue *plimit = ra + 1;");
-        PP_writeln(&pp, "TValue *pstep = ra + 2;");
-        PP_writeln(&pp, "lua_Integer ilimit;");
-        PP_writeln(&pp, "int stopnow;");
-        PP_writeln(&pp, "if (ttisinteger(init) && ttisinteger(pstep) &&");
-        PP_writeln(&pp, "    luaV_forlimit(plimit, &ilimit, ivalue(pstep), &stopnow)) {");
-        PP_writeln(&pp, "  /* all values are integer */");
-        PP_writeln(&pp, "  lua_Integer initv = (stopnow ? 0 : ivalue(init));");
-        PP_writeln(&pp, "  setivalue(plimit, ilimit);");
-        PP_writeln(&pp, "  setivalue(init, intop(-, initv, ivalue(pstep)));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "else {  /* try making all values floats */");
-        PP_writeln(&pp, "  lua_Number ninit; lua_Number nlimit; lua_Number nstep;");
-        PP_writeln(&pp, "  if (!tonumber(plimit, &nlimit))");
-        PP_writeln(&pp, "    luaG_runerror(L, \"'for' limit must be a number\");");
-        PP_writeln(&pp, "  setfltvalue(plimit, nlimit);");
-        PP_writeln(&pp, "  if (!tonumber(pstep, &nstep))");
-        PP_writeln(&pp, "    luaG_runerror(L, \"'for' step must be a number\");");
-        PP_writeln(&pp, "  setfltvalue(pstep, nstep);");
-        PP_writeln(&pp, "  if (!tonumber(init, &ninit))");
-        PP_writeln(&pp, "    luaG_runerror(L, \"'for' initial value must be a number\");");
-        PP_writeln(&pp, "  setfltvalue(init, luai_numsub(L, ninit, nstep));");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "ci->u.l.savedpc += GETARG_sBx(i);");
-        PP_writeln(&pp, "goto label_%d;", target);
-      } break;
-
-      case OP_TFORCALL: {
-        PP_writeln(&pp, "StkId cb = ra + 3;  /* call base */");
-        PP_writeln(&pp, "setobjs2s(L, cb+2, ra+2);");
-        PP_writeln(&pp, "setobjs2s(L, cb+1, ra+1);");
-        PP_writeln(&pp, "setobjs2s(L, cb, ra);");
-        PP_writeln(&pp, "L->top = cb + 3;  /* func. + 2 args (state and index) */");
-        PP_writeln(&pp, "Protect(luaD_call(L, cb, GETARG_C(i)));");
-        PP_writeln(&pp, "L->top = ci->top;");
-
-        assert(pc+1 < nopcodes);
-        assert(GET_OPCODE(code[pc+1]) == OP_TFORLOOP);
-      } break;
-
-      case OP_TFORLOOP: {
-        int target = pc + GETARG_sBx(i) + 1;
-        PP_writeln(&pp, "if (!ttisnil(ra + 1)) {  /* continue loop? */");
-        PP_writeln(&pp, "  setobjs2s(L, ra, ra + 1);  /* save control variable */");
-        PP_writeln(&pp, "  ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */");
-        PP_writeln(&pp, "  goto label_%d; /* jump back */", target);
-        PP_writeln(&pp, "}");
-      } break;
-
-      case OP_SETLIST: {
-        assert(pc + 1 < nopcodes);
-        Instruction next_i = code[pc+1];
-
-        PP_writeln(&pp, "int n = GETARG_B(i);");
-        PP_writeln(&pp, "int c = GETARG_C(i);");
-        PP_writeln(&pp, "unsigned int last;");
-        PP_writeln(&pp, "Table *h;");
-        PP_writeln(&pp, "if (n == 0) n = cast_int(L->top - ra) - 1;");
-        PP_writeln(&pp, "if (c == 0) {");
-        PP_writeln(&pp, "  lua_assert(GET_OPCODE(*ci->u.l.savedpc) == OP_EXTRAARG);", next_i);
-        PP_writeln(&pp, "  c = GETARG_Ax(*ci->u.l.savedpc++);", next_i); //(!)
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "h = hvalue(ra);");
-        PP_writeln(&pp, "last = ((c-1)*LFIELDS_PER_FLUSH) + n;");
-        PP_writeln(&pp, "if (last > h->sizearray)  /* needs more space? */");
-        PP_writeln(&pp, "  luaH_resizearray(L, h, last);  /* preallocate it at once */");
-        PP_writeln(&pp, "for (; n > 0; n--) {");
-        PP_writeln(&pp, "  TValue *val = ra+n;");
-        PP_writeln(&pp, "  luaH_setint(L, h, last--, val);");
-        PP_writeln(&pp, "  luaC_barrierback(L, h, val);");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "L->top = ci->top;  /* correct top (in case of previous open call) */");
-      } break;
-
-      case OP_CLOSURE: {
-        PP_writeln(&pp, "Proto *p = cl->p->p[GETARG_Bx(i)];");
-        PP_writeln(&pp, "LClosure *ncl = luaV_getcached(p, cl->upvals, base);  /* cached closure*/");
-        PP_writeln(&pp, "if (ncl == NULL)  /* no match? */");
-        PP_writeln(&pp, "  luaV_pushclosure(L, p, cl->upvals, base, ra);  /* create a new one */");
-        PP_writeln(&pp, "else");
-        PP_writeln(&pp, "  setclLvalue(L, ra, ncl);  /* push cashed closure */");
-        PP_writeln(&pp, "checkGC(L, ra + 1);");
-      } break;
-
-      case OP_VARARG: {
-        PP_writeln(&pp, "int b = GETARG_B(i) - 1;  /* required results */");
-        PP_writeln(&pp, "int j;");
-        PP_writeln(&pp, "int n = cast_int(base - ci->func) - cl->p->numparams - 1;");
-        PP_writeln(&pp, "if (n < 0)  /* less arguments than parameters? */");
-        PP_writeln(&pp, "  n = 0;  /* no vararg arguments */");
-        PP_writeln(&pp, "if (b < 0) {  /* B == 0? */");
-        PP_writeln(&pp, "  b = n;  /* get all var. arguments */");
-        PP_writeln(&pp, "  Protect(luaD_checkstack(L, n));");
-        PP_writeln(&pp, "  ra = RA(i);  /* previous call may change the stack */");
-        PP_writeln(&pp, "  L->top = ra + n;");
-        PP_writeln(&pp, "}");
-        PP_writeln(&pp, "for (j = 0; j < b && j < n; j++)");
-        PP_writeln(&pp, "  setobjs2s(L, ra + j, base - n + j);");
-        PP_writeln(&pp, "for (; j < b; j++)  /* complete required results with nil */");
-        PP_writeln(&pp, "  setnilvalue(ra + j);");
-      } break;
-
-      case OP_EXTRAARG: {
-        PP_writeln(&pp, "(void) ra;");
-        PP_writeln(&pp, "// NO OP");
-      } break;
+static TypeSet RKType(const TypeInfo *ti, const TypeSet *regs, int x)
+{
+  return ISK(x) ? ConstantType(ti->f, INDEXK(x)) : regs[x];
+}
 
-      default: {
-        fprintf(stderr, "Uninplemented opcode %s", luaP_opnames[o]);
-        fatal("aborting");
-      } break;
-    }
-    PP_dedent(&pp); PP_writeln(&pp, "}");
-    PP_writeln(&pp, "");
+static TypeSet ArithType(OpCode o, TypeSet tb, TypeSet tc)
+{
+  if ((tb | tc) & T_OTHER) return T_ANY; /* string coercions or metamethods */
+  switch (o) {
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_MOD: case OP_IDIV:
+      if (tb == T_INTEGER && tc == T_INTEGER) return T_INTEGER;
+      if (tb == T_FLOAT || tc == T_FLOAT) return T_FLOAT;
+      return T_NUMBER;
+    case OP_DIV: case OP_POW:
+      return T_FLOAT;
+    case OP_BAND: case OP_BOR: case OP_BXOR: case OP_SHL: case OP_SHR:
+      return T_INTEGER; /* or it raises an error */
+    default:
+      assert(0);
+      return T_ANY;
   }
-  PP_dedent(&pp); PP_writeln(&pp, "}");
-  PP_writeln(&pp, "");
 }
 
-#define SS(x)	((x==1)?"":"s")
-#define S(x)	(int)(x),SS(x)
-
-static void PrintFunction(const Proto* f)
+// Fills in the successors of an instruction. Returns how many there are.
+static int Successors(const Proto *f, int pc, int *succ)
 {
-  int n=f->sizep;
-  PrintCode(f);
-  NFUNCTIONS++;
-  for (int i=0; i<n; i++) {
-    PrintFunction(f->p[i]);
+  Instruction i = f->code[pc];
+  switch (GET_OPCODE(i)) {
+    case OP_JMP:
+      succ[0] = pc + 1 + GETARG_sBx(i);
+      return 1;
+    case OP_FORPREP:
+      succ[0] = pc + 1 + GETARG_sBx(i);
+      if (!FloatEntry(pc)) return 1;
+      succ[1] = FloatEntry(pc);
+      return 2;
+    case OP_FORLOOP:
+      succ[0] = LoopExit(pc);
+      succ[1] = pc + 1 + GETARG_sBx(i);
+      return 2;
+    case OP_TFORLOOP:
+      succ[0] = pc + 1;
+      succ[1] = pc + 1 + GETARG_sBx(i);
+      return 2;
+    case OP_EQ: case OP_LT: case OP_LE:
+    case OP_TEST: case OP_TESTSET:
+      succ[0] = pc + 1;
+      succ[1] = pc + 2;
+      return 2;
+    case OP_LOADBOOL:
+      succ[0] = (GETARG_C(i) ? pc + 2 : pc + 1);
+      return 1;
+    case OP_LOADKX:
+      succ[0] = pc + 2;
+      return 1;
+    case OP_SETLIST:
+      succ[0] = (GETARG_C(i) == 0 ? pc + 2 : pc + 1);
+      return 1;
+    case OP_RETURN:
+      return 0;
+    default:
+      succ[0] = pc + 1;
+      return 1;
   }
 }
+
+static void SetTypesFrom(TypeSet *regs, int nregs, int first, TypeSet t)
+{
+  for (int r = first; r < nregs; r++) regs[r] = t;
+}
+
+// Computes the register types along the edge from pc to succ.
+static void TransferTypes(const TypeInfo *ti, int pc, int succ, TypeSet *regs)
+{
+  const Proto *f = ti->f;
+  Instruction i = f->code[pc];
+  OpCode o = GET_OPCODE(i);
+  int a = GETARG_A(i);
+  int b = GETARG_B(i);
+  int c = GETARG_C(i);
+
+  switch (o) {
+    case OP_MOVE:
+      regs[a] = regs[b];
+      break;
+    case OP_LOADK:
+      regs[a] = ConstantType(f, GETARG_Bx(i));
+      break;
+    case OP_LOADKX:
+      regs[a] = ConstantType(f, GETARG_Ax(f->code[pc+1]));
+      break;
+    case OP_LOADBOOL:
+    case OP_NEWTABLE:
+    case OP_NOT:
+    case OP_CLOSURE:
+      regs[a] = T_OTHER;
+      break;
+    case OP_LOADNIL:
+      for (int r = a; r <= a + b; r++) regs[r] = T_OTHER;
+      break;
+    case OP_GETUPVAL:
+    case OP_GETTABUP:
+    case OP_GETTABLE:
+    case OP_LEN:
+      regs[a] = T_ANY;
+      break;
+    case OP_SELF:
+      regs[a] = T_ANY;
+      regs[a+1] = T_ANY;
+      break;
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_MOD: case OP_IDIV:
+    case OP_DIV: case OP_POW:
+    case OP_BAND: case OP_BOR: case OP_BXOR: case OP_SHL: case OP_SHR:
+      regs[a] = ArithType(o, RKType(ti, regs, b), RKType(ti, regs, c));
+      break;
+    case OP_UNM:
+      regs[a] = (regs[b] & T_OTHER) ? T_ANY : regs[b];
+      break;
+    case OP_BNOT:
+      regs[a] = (regs[b] & T_OTHER) ? T_ANY : T_INTEGER;
+      break;
+    case OP_CONCAT:
+      /* luaV_concat works in place, above R(B) */
+      SetTypesFrom(regs, ti->nregs, b, T_ANY);
+      regs[a] = T_ANY;
+      break;
+    case OP_TESTSET:
+      if (succ == pc + 1) regs[a] = regs[b];
+      break;
+    case OP_CALL:
+    case OP_TAILCALL:
+    case OP_VARARG:
+      /* the callee (or the varargs) may use everything above R(A) */
+      SetTypesFrom(regs, ti->nregs, a, T_ANY);
+      break;
+    case OP_TFORCALL:
+      SetTypesFrom(regs, ti->nregs, a + 3, T_ANY);
+      break;
+    case OP_TFORLOOP:
+      regs[a] = T_ANY;
+      break;
+    case OP_FORPREP: {
+      TypeSet t;
+      if (FloatEntry(pc))
+        t = (succ == FloatEntry(pc) ? T_FLOAT : T_INTEGER); /* see VersionLoops */
+      else if (regs[a] == T_INTEGER && regs[a+2] == T_INTEGER)
+        t = T_INTEGER; /* (or 'for' limit is not a number, and it errors) */
+      else if (!(regs[a] & T_INTEGER) || !(regs[a+2] & T_INTEGER))
+        t = T_FLOAT;
+      else
+        t = T_NUMBER;
+      regs[a] = regs[a+1] = regs[a+2] = t;
+    } break;
+    case OP_FORLOOP:
+      if (succ != LoopExit(pc)) regs[a+3] = regs[a];
+      break;
+    default:
+      break;
+  }
+
+  for (int r = 0; r < ti->nregs; r++) {
+    if (ti->captured[r]) regs[r] = T_ANY;
+  }
+}
+
+static void AnalyzeTypes(TypeInfo *ti, const Proto *f)
+{
+  int n = f->sizecode;
+  int nregs = f->maxstacksize;
+
+  ti->f = f;
+  ti->nregs = nregs;
+  ti->reached = calloc(n, sizeof(char));
+  ti->captured = calloc(nregs, sizeof(char));
+  ti->types = calloc((size_t) n * nregs, sizeof(TypeSet));
+  ti->live = NULL;
+  ti->range = ti->def_range = ti->nlocals = NULL;
+  ti->unboxed = NULL;
+  if (!ti->reached || !ti->captured || !ti->types) fatal("out of memory");
+
+  // A register that is captured by a closure can be assigned to by any
+  // function call, so we give up on tracking its type.
+  for (int pc = 0; pc < n; pc++) {
+    Instruction i = f->code[pc];
+    if (GET_OPCODE(i) == OP_CLOSURE) {
+      const Proto *p = f->p[GETARG_Bx(i)];
+      for (int u = 0; u < p->sizeupvalues; u++) {
+        if (p->upvalues[u].instack) ti->captured[p->upvalues[u].idx] = 1;
+      }
+    }
+  }
+
+  ti->reached[0] = 1;
+  SetTypesFrom(REGTYPES(ti, 0), nregs, 0, T_ANY);
+
+  TypeSet *regs = malloc(nregs);
+  if (!regs) fatal("out of memory");
+
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    for (int pc = 0; pc < n; pc++) {
+      if (!ti->reached[pc]) continue;
+
+      int succ[2];
+      int nsucc = Successors(f, pc, succ);
+      for (int s = 0; s < nsucc; s++) {
+        memcpy(regs, REGTYPES(ti, pc), nregs);
+        TransferTypes(ti, pc, succ[s], regs);
+
+        TypeSet *dst = REGTYPES(ti, succ[s]);
+        if (!ti->reached[succ[s]]) {
+          ti->reached[succ[s]] = 1;
+          changed = 1;
+        }
+        for (int r = 0; r < nregs; r++) {
+          TypeSet t = dst[r] | regs[r];
+          if (t != dst[r]) { dst[r] = t; changed = 1; }
+        }
+      }
+    }
+  }
+
+  free(regs);
+
+  // Make no assumptions about unreachable code
+  for (int pc = 0; pc < n; pc++) {
+    if (!ti->reached[pc]) SetTypesFrom(REGTYPES(ti, pc), nregs, 0, T_ANY);
+  }
+}
+
+static void FreeTypeInfo(TypeInfo *ti)
+{
+  free(ti->reached);
+  free(ti->captured);
+  free(ti->types);
+  free(ti->live);
+  free(ti->range);
+  free(ti->def_range);
+  free(ti->unboxed);
+  free(ti->nlocals);
+}
+
+/*
+** Loop versioning
+** ===============
+**
+** When the analysis cannot tell whether a numeric for loop counts with
+** integers or with floats (say, 'for i = a, b, step' with parameters), every
+** use of the index in the body has to check its type. So we compile the body
+** twice: FORPREP jumps into the original body if the loop is an integer loop
+** and into a copy of it if it is a float loop, and the type analysis then
+** knows the type of the index in each of them.
+**
+** The copies are appended to the code of the function, in a Proto that is
+** only used by the code generator. A copy ends with its FORLOOP, which jumps
+** back to the instruction after the original loop when the loop ends. Jumps
+** that leave the copied body (break, goto) go to the original code. Every
+** copied instruction remembers its real pc, for savedpc, the hooks and the
+** profile, so the running program cannot tell the two versions apart.
+*/
+
+#define MAX_VERSIONED_LOOP 200  /* don't copy loops with more instructions */
+
+static int *real_pc;      /* real_pc[pc]: the pc of the instruction in the Proto */
+static int *float_entry;  /* float_entry[pc]: float copy of the loop of a FORPREP */
+static int *loop_exit;    /* loop_exit[pc]: where the FORLOOP of a copy exits to */
+
+static int RealPc(int pc)
+{
+  return (real_pc ? real_pc[pc] : pc);
+}
+
+// The FORLOOP in the float copy of the loop of this FORPREP (0 if none)
+static int FloatEntry(int pc)
+{
+  return (float_entry ? float_entry[pc] : 0);
+}
+
+// Where a FORLOOP continues when the loop ends
+static int LoopExit(int pc)
+{
+  return (loop_exit && loop_exit[pc] ? loop_exit[pc] : pc + 1);
+}
+
+// Should we copy the loop of the instruction at pc? Only if it is a FORPREP
+// of a loop that may be an integer or a float loop, and only if the body is
+// a small block that we can copy as is.
+static int IsVersionedLoop(const TypeInfo *ti, int pc)
+{
+  const Proto *f = ti->f;
+  Instruction i = f->code[pc];
+  if (GET_OPCODE(i) != OP_FORPREP || !ti->reached[pc]) return 0;
+
+  int a = GETARG_A(i);
+  const TypeSet *types = REGTYPES(ti, pc);
+  if (!(types[a] & T_INTEGER) || !(types[a+2] & T_INTEGER)) return 0;
+  if (types[a] == T_INTEGER && types[a+2] == T_INTEGER) return 0;
+
+  int first = pc + 1;
+  int last = pc + 1 + GETARG_sBx(i);
+  Instruction forloop = f->code[last];
+  if (last - first >= MAX_VERSIONED_LOOP) return 0;
+  if (GET_OPCODE(forloop) != OP_FORLOOP ||
+      last + 1 + GETARG_sBx(forloop) != first) return 0;
+  for (int q = first; q < last; q++) {
+    switch (GET_OPCODE(f->code[q])) {
+      case OP_JMP: case OP_FORPREP: case OP_FORLOOP: case OP_TFORLOOP:
+        continue;  /* we can change where these jump to */
+      default: {
+        int succ[2];
+        int nsucc = Successors(f, q, succ);
+        for (int s = 0; s < nsucc; s++) {
+          if (succ[s] < first || succ[s] > last) return 0;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+// Builds the code with the copies of the loops in vf, and fills in real_pc,
+// float_entry and loop_exit. Returns 0 if there are no loops to copy.
+static int VersionLoops(const TypeInfo *ti, Proto *vf)
+{
+  const Proto *f = ti->f;
+  int n = f->sizecode;
+
+  int size = n;
+  for (int pc = 0; pc < n; pc++) {
+    if (IsVersionedLoop(ti, pc)) size += GETARG_sBx(f->code[pc]) + 1;
+  }
+  if (size == n || size > MAXARG_sBx) return 0;  /* (so that all jumps fit) */
+
+  Instruction *code = malloc(size * sizeof(Instruction));
+  real_pc = malloc(size * sizeof(int));
+  float_entry = calloc(size, sizeof(int));
+  loop_exit = calloc(size, sizeof(int));
+  if (!code || !real_pc || !float_entry || !loop_exit) fatal("out of memory");
+
+  for (int pc = 0; pc < n; pc++) {
+    code[pc] = f->code[pc];
+    real_pc[pc] = pc;
+  }
+  int top = n;
+  for (int pc = 0; pc < n; pc++) {
+    if (!IsVersionedLoop(ti, pc)) continue;
+    int first = pc + 1;
+    int last = pc + 1 + GETARG_sBx(f->code[pc]);
+    for (int q = first; q <= last; q++) {
+      Instruction i = f->code[q];
+      switch (GET_OPCODE(i)) {
+        case OP_JMP: case OP_FORPREP: case OP_FORLOOP: case OP_TFORLOOP: {
+          int target = q + 1 + GETARG_sBx(i);
+          if (target < first || target > last) SETARG_sBx(i, target - (top + 1));
+        } break;
+        default:
+          break;
+      }
+      code[top] = i;
+      real_pc[top] = q;
+      top++;
+    }
+    float_entry[pc] = top - 1;
+    loop_exit[top - 1] = last + 1;
+  }
+  assert(top == size);
+
+  *vf = *f;
+  vf->code = code;
+  vf->sizecode = size;
+  return 1;
+}
+
+static void FreeVersionedLoops(Proto *vf)
+{
+  free(vf->code);
+  free(real_pc);
+  free(float_entry);
+  free(loop_exit);
+  real_pc = float_entry = loop_exit = NULL;
+}
+
+/*
+** Unboxed registers
+** =================
+**
+** The compiler reuses registers for unrelated values (the loop counter of a
+** 'for' and then the function of a call after the loop, say), so we look at
+** the live ranges of each register instead: a live range is a set of
+** assignments to a register together with the instructions that read their
+** values. A live range whose type is the same (integer or float) at every
+** instruction that reads it can live in a plain C local variable instead of
+** in the Lua stack. The code generator reads and writes these locals directly
+** in the specialized numeric code and writes them back to the stack
+** ("spills") when someone else might look at the stack: before generic
+** instructions that read them, and inside every Protect (calls, metamethods,
+** hooks, GC steps). Each instruction gets a ZZ_SPILL that writes back the
+** live ranges that hold the registers at that point, and a ZZ_RELOAD that
+** reads back the ones that are still live after the instruction, in case
+** the code in the Protect changed them with debug.setlocal.
+**
+** It is OK to leave a stale value in a stack slot whose register is dead,
+** because nobody reads such a slot before it is assigned again.
+*/
+
+// Marks the registers that an instruction reads.
+static void RegistersRead(const Proto *f, int pc, char *reads)
+{
+  int nregs = f->maxstacksize;
+  Instruction i = f->code[pc];
+  int a = GETARG_A(i);
+  int b = GETARG_B(i);
+  int c = GETARG_C(i);
+  int first = 0, last = -1;  /* range of registers */
+
+  memset(reads, 0, nregs);
+
+  switch (GET_OPCODE(i)) {
+    case OP_MOVE: case OP_UNM: case OP_BNOT: case OP_NOT: case OP_LEN:
+    case OP_TESTSET:
+      reads[b] = 1;
+      break;
+    case OP_GETTABUP:
+      if (!ISK(c)) reads[c] = 1;
+      break;
+    case OP_GETTABLE: case OP_SELF:
+      reads[b] = 1;
+      if (!ISK(c)) reads[c] = 1;
+      break;
+    case OP_SETTABLE:
+      reads[a] = 1;
+      /* FALLTHROUGH */
+    case OP_SETTABUP:
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_MOD: case OP_POW:
+    case OP_DIV: case OP_IDIV: case OP_BAND: case OP_BOR: case OP_BXOR:
+    case OP_SHL: case OP_SHR:
+    case OP_EQ: case OP_LT: case OP_LE:
+      if (!ISK(b)) reads[b] = 1;
+      if (!ISK(c)) reads[c] = 1;
+      break;
+    case OP_SETUPVAL: case OP_TEST:
+      reads[a] = 1;
+      break;
+    case OP_CONCAT:
+      first = b; last = c;
+      break;
+    case OP_CALL: case OP_TAILCALL:
+      first = a; last = (b != 0 ? a + b - 1 : nregs - 1);
+      break;
+    case OP_RETURN:
+      first = a; last = (b != 0 ? a + b - 2 : nregs - 1);
+      break;
+    case OP_SETLIST:
+      first = a; last = (b != 0 ? a + b : nregs - 1);
+      break;
+    case OP_FORLOOP: case OP_FORPREP: case OP_TFORCALL:
+      first = a; last = a + 2;
+      break;
+    case OP_TFORLOOP:
+      reads[a+1] = 1;
+      break;
+    default:
+      break;
+  }
+
+  for (int r = first; r <= last && r < nregs; r++) reads[r] = 1;
+}
+
+// Marks the registers that an instruction assigns to when it continues to
+// succ. The other registers keep their values (and their live ranges).
+static void RegistersWritten(const Proto *f, int pc, int succ, char *writes)
+{
+  int nregs = f->maxstacksize;
+  Instruction i = f->code[pc];
+  OpCode o = GET_OPCODE(i);
+  int a = GETARG_A(i);
+  int first = 0, last = -1;  /* range of registers */
+
+  memset(writes, 0, nregs);
+
+  switch (o) {
+    case OP_LOADNIL:
+      first = a; last = a + GETARG_B(i);
+      break;
+    case OP_SELF:
+      first = a; last = a + 1;
+      break;
+    case OP_CONCAT:
+      writes[a] = 1;
+      first = GETARG_B(i); last = nregs - 1;
+      break;
+    case OP_CALL: case OP_TAILCALL: case OP_VARARG:
+      first = a; last = nregs - 1;
+      break;
+    case OP_TFORCALL:
+      first = a + 3; last = nregs - 1;
+      break;
+    case OP_TESTSET:
+      if (succ == pc + 1) writes[a] = 1;
+      break;
+    case OP_FORPREP:
+      first = a; last = a + 2;
+      break;
+    case OP_FORLOOP:
+      if (succ != LoopExit(pc)) { writes[a] = 1; writes[a+3] = 1; }
+      break;
+    case OP_TFORLOOP:
+      if (succ != pc + 1) writes[a] = 1;
+      break;
+    default:
+      if (testAMode(o)) writes[a] = 1;
+      break;
+  }
+
+  for (int r = first; r <= last && r < nregs; r++) writes[r] = 1;
+}
+
+// The assignment to register r by the instruction at pc, when it continues to
+// succ. A versioned FORPREP assigns integers in one direction and floats in
+// the other (see VersionLoops), so those are two different assignments.
+static int DefinitionId(const TypeInfo *ti, int pc, int succ, int r)
+{
+  int version = (FloatEntry(pc) && succ == FloatEntry(pc));
+  return (1 + 2 * pc + version) * ti->nregs + r;  /* 0..nregs-1: the entry */
+}
+
+static int FindRange(int *parent, int d)
+{
+  while (parent[d] != d) {
+    parent[d] = parent[parent[d]];
+    d = parent[d];
+  }
+  return d;
+}
+
+#define NO_RANGE   (-1)  /* not reached yet */
+#define MANY_RANGES (-2) /* a dead register assigned in more than one range */
+
+// Computes the live range of every register before every instruction. The
+// assignments that reach an instruction where the register is live belong to
+// the same live range, which is named after one of them.
+static void FindLiveRanges(TypeInfo *ti)
+{
+  const Proto *f = ti->f;
+  int n = f->sizecode;
+  int nregs = ti->nregs;
+  int ndefs = (2 * n + 1) * nregs;
+
+  char *live = calloc((size_t) n * nregs, 1);
+  char *reads = malloc(nregs);
+  char *writes = malloc(nregs);
+  int *range = malloc((size_t) n * nregs * sizeof(int));
+  int *parent = malloc((size_t) ndefs * sizeof(int));
+  if (!live || !reads || !writes || !range || !parent) fatal("out of memory");
+
+  // Liveness: r is live before pc if some path from pc reads r before
+  // assigning to it.
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    for (int pc = n - 1; pc >= 0; pc--) {
+      char *here = live + (size_t) pc * nregs;
+      RegistersRead(f, pc, reads);
+      int succ[2];
+      int nsucc = Successors(f, pc, succ);
+      for (int s = 0; s < nsucc; s++) {
+        const char *there = live + (size_t) succ[s] * nregs;
+        RegistersWritten(f, pc, succ[s], writes);
+        for (int r = 0; r < nregs; r++) {
+          if (there[r] && !writes[r]) reads[r] = 1;
+        }
+      }
+      for (int r = 0; r < nregs; r++) {
+        if (reads[r] && !here[r]) { here[r] = 1; changed = 1; }
+      }
+    }
+  }
+
+  // Forward propagation of the assignments, merging the live ranges where
+  // they meet.
+  for (int d = 0; d < ndefs; d++) parent[d] = d;
+  for (int i = 0; i < n * nregs; i++) range[i] = NO_RANGE;
+  for (int r = 0; r < nregs; r++) range[r] = r;
+
+  changed = 1;
+  while (changed) {
+    changed = 0;
+    for (int pc = 0; pc < n; pc++) {
+      if (!ti->reached[pc]) continue;
+      int succ[2];
+      int nsucc = Successors(f, pc, succ);
+      for (int s = 0; s < nsucc; s++) {
+        RegistersWritten(f, pc, succ[s], writes);
+        for (int r = 0; r < nregs; r++) {
+          int d = (writes[r] ? DefinitionId(ti, pc, succ[s], r)
+                             : range[pc * nregs + r]);
+          int *dst = &range[succ[s] * nregs + r];
+          if (d == NO_RANGE || *dst == MANY_RANGES) continue;
+          if (*dst == NO_RANGE) {
+            *dst = d;
+            changed = 1;
+          } else if (d == MANY_RANGES) {
+            assert(!live[succ[s] * nregs + r]);
+            *dst = MANY_RANGES;
+            changed = 1;
+          } else {
+            int x = FindRange(parent, *dst), y = FindRange(parent, d);
+            if (x == y) continue;
+            if (live[succ[s] * nregs + r]) parent[y] = x;
+            else *dst = MANY_RANGES;
+            changed = 1;
+          }
+        }
+      }
+    }
+  }
+
+  for (int d = 0; d < ndefs; d++) parent[d] = FindRange(parent, d);
+  for (int i = 0; i < n * nregs; i++) {
+    if (range[i] >= 0) range[i] = parent[range[i]];
+  }
+
+  ti->live = live;
+  ti->range = range;
+  ti->def_range = parent;
+  free(reads);
+  free(writes);
+}
+
+static void ChooseUnboxedRegisters(TypeInfo *ti)
+{
+  const Proto *f = ti->f;
+  int nregs = ti->nregs;
+  int ndefs = (2 * f->sizecode + 1) * nregs;
+
+  FindLiveRanges(ti);
+  ti->unboxed = calloc(ndefs, sizeof(TypeSet));
+  ti->nlocals = calloc(nregs, sizeof(int));
+  char *reads = malloc(nregs);
+  if (!ti->unboxed || !ti->nlocals || !reads) fatal("out of memory");
+
+  // First collect the types seen by every read. T_ANY means "give up".
+  TypeSet *seen = ti->unboxed;
+  for (int pc = 0; pc < f->sizecode; pc++) {
+    if (!ti->reached[pc]) continue;
+    RegistersRead(f, pc, reads);
+    const TypeSet *types = REGTYPES(ti, pc);
+    for (int r = 0; r < nregs; r++) {
+      if (!reads[r]) continue;
+      int w = ti->range[pc * nregs + r];
+      assert(w >= 0);
+      TypeSet t = types[r];
+      if (ti->captured[r] || (t != T_INTEGER && t != T_FLOAT)) seen[w] = T_ANY;
+      else if (seen[w] == 0) seen[w] = t;
+      else if (seen[w] != t) seen[w] = T_ANY;
+    }
+  }
+  for (int w = 0; w < ndefs; w++) {
+    if (seen[w] == T_ANY) seen[w] = 0;
+    if (seen[w]) ti->nlocals[w % nregs]++;
+  }
+
+  free(reads);
+}
+
+// The live range of register r before pc, if it is unboxed (else -1)
+static int UnboxedRange(const TypeInfo *ti, int pc, int r)
+{
+  int w = ti->range[pc * ti->nregs + r];
+  return (w >= 0 && ti->unboxed[w] ? w : -1);
+}
+
+// The live range of the value that the instruction at pc assigns to r, when
+// it continues to succ, if it is unboxed (else -1)
+static int UnboxedDefinition(const TypeInfo *ti, int pc, int succ, int r)
+{
+  int w = ti->def_range[DefinitionId(ti, pc, succ, r)];
+  return (ti->unboxed[w] ? w : -1);
+}
+
+static const char *UnboxedName(const TypeInfo *ti, int w)
+{
+  static char buf[32];
+  int r = w % ti->nregs;
+  const char *type = (ti->unboxed[w] == T_INTEGER ? "int" : "flt");
+  if (ti->nlocals[r] == 1)
+    snprintf(buf, sizeof(buf), "r%d_%s", r, type);
+  else
+    snprintf(buf, sizeof(buf), "r%d_%d_%s", r, w / ti->nregs, type);
+  return buf;
+}
+
+// Writes the unboxed registers that are marked in 'regs' (all of them if it
+// is NULL) back to the stack, before the instruction at pc.
+static void PrintSpills(const TypeInfo *ti, int pc, const char *regs)
+{
+  for (int r = 0; r < ti->nregs; r++) {
+    if (regs && !regs[r]) continue;
+    int w = UnboxedRange(ti, pc, r);
+    if (w < 0) continue;
+    PP_writeln(&pp, "set%svalue(base + %d, %s);",
+               (ti->unboxed[w] == T_INTEGER ? "i" : "flt"), r, UnboxedName(ti, w));
+  }
+}
+
+// The registers that ZZ_SPILL writes back inside the code for the
+// instruction at pc. Leaves out the registers that the instruction assigns
+// to, because their slots may already have the new values.
+static void SpilledRanges(const TypeInfo *ti, int pc, int *spilled)
+{
+  char *writes = malloc(ti->nregs);
+  char *all = calloc(ti->nregs, 1);
+  if (!writes || !all) fatal("out of memory");
+  int succ[2];
+  int nsucc = Successors(ti->f, pc, succ);
+  for (int s = 0; s < nsucc; s++) {
+    RegistersWritten(ti->f, pc, succ[s], writes);
+    for (int r = 0; r < ti->nregs; r++) all[r] |= writes[r];
+  }
+  for (int r = 0; r < ti->nregs; r++) {
+    spilled[r] = (all[r] ? -1 : UnboxedRange(ti, pc, r));
+  }
+  free(writes);
+  free(all);
+}
+
+// The registers that ZZ_RELOAD reads back after the code in a Protect: the
+// ones that ZZ_SPILL wrote and that are still live after the instruction.
+static void ReloadedRanges(const TypeInfo *ti, int pc, int *reloaded)
+{
+  int succ[2];
+  int nsucc = Successors(ti->f, pc, succ);
+  SpilledRanges(ti, pc, reloaded);
+  for (int r = 0; r < ti->nregs; r++) {
+    int live = 0;
+    for (int s = 0; s < nsucc; s++) live |= ti->live[succ[s] * ti->nregs + r];
+    if (!live) reloaded[r] = -1;
+  }
+}
+
+// Reads the live range w back from the stack, checking that the value still
+// has the type of the C local. 'end' goes at the end of the line.
+static void PrintCheckedReload(const TypeInfo *ti, int w, const char *end)
+{
+  PP_writeln(&pp, "zz_reload%s(L, base + %d, %s);%s",
+             (ti->unboxed[w] == T_INTEGER ? "int" : "flt"), w % ti->nregs,
+             UnboxedName(ti, w), end);
+}
+
+// Defines ZZ_SPILL and ZZ_RELOAD for the code of the instruction at pc,
+// unless the current definitions already do the right thing. 'current' is
+// what they spill and reload now: current[0..nregs-1] is spilled,
+// current[nregs] is the innermost loop whose guard ZZ_SPILL clears (see
+// FindGuardedLoops) and current[nregs+1..2*nregs] is reloaded.
+static void PrintSpillMacro(const TypeInfo *ti, int pc, int *current)
+{
+  int nregs = ti->nregs;
+  int *spilled = malloc((2 * nregs + 1) * sizeof(int));
+  if (!spilled) fatal("out of memory");
+  int *reloaded = spilled + nregs + 1;
+  SpilledRanges(ti, pc, spilled);
+  spilled[nregs] = GuardedLoop(pc);
+  ReloadedRanges(ti, pc, reloaded);
+  if (memcmp(spilled, current, (nregs + 1) * sizeof(int)) != 0) {
+    int any = 0;
+    for (int r = 0; r <= nregs; r++) any |= (spilled[r] >= 0);
+    PP_writeln(&pp, "#undef ZZ_SPILL");
+    if (!any) {
+      PP_writeln(&pp, "#define ZZ_SPILL() ((void)0)");
+    } else {
+      PP_writeln(&pp, "#define ZZ_SPILL() { \\");
+      PP_indent(&pp);
+      for (int r = 0; r < nregs; r++) {
+        if (spilled[r] < 0) continue;
+        PP_writeln(&pp, "set%svalue(base + %d, %s); \\",
+                   (ti->unboxed[spilled[r]] == T_INTEGER ? "i" : "flt"), r,
+                   UnboxedName(ti, spilled[r]));
+      }
+      for (int l = spilled[nregs]; l >= 0; l = GuardedLoop(l)) {
+        PP_writeln(&pp, "guard_%d = 0; \\", l);
+      }
+      PP_dedent(&pp);
+      PP_writeln(&pp, "}");
+    }
+  }
+  if (memcmp(reloaded, current + nregs + 1, nregs * sizeof(int)) != 0) {
+    int any = 0;
+    for (int r = 0; r < nregs; r++) any |= (reloaded[r] >= 0);
+    PP_writeln(&pp, "#undef ZZ_RELOAD");
+    if (!any) {
+      PP_writeln(&pp, "#define ZZ_RELOAD() ((void)0)");
+    } else {
+      PP_writeln(&pp, "#define ZZ_RELOAD() { \\");
+      PP_indent(&pp);
+      for (int r = 0; r < nregs; r++) {
+        if (reloaded[r] >= 0) PrintCheckedReload(ti, reloaded[r], " \\");
+      }
+      PP_dedent(&pp);
+      PP_writeln(&pp, "}");
+    }
+  }
+  memcpy(current, spilled, (2 * nregs + 1) * sizeof(int));
+  free(spilled);
+}
+
+// Reloads the live range w after a generic instruction wrote a value of type
+// t to its register in the stack.
+static void PrintReload(const TypeInfo *ti, int w, TypeSet t)
+{
+  if (w >= 0 && ti->unboxed[w] == t) {
+    PP_writeln(&pp, "%s = %s(base + %d);", UnboxedName(ti, w),
+               (t == T_INTEGER ? "ivalue" : "fltvalue"), w % ti->nregs);
+  }
+}
+
+// Reloads the unboxed registers in [first, last] that the generic code for the
+// instruction at pc wrote to the stack.
+static void PrintReloadRange(const TypeInfo *ti, int pc, int succ, int first, int last)
+{
+  TypeSet *after = malloc(ti->nregs);
+  if (!after) fatal("out of memory");
+  memcpy(after, REGTYPES(ti, pc), ti->nregs);
+  TransferTypes(ti, pc, succ, after);
+  for (int r = first; r <= last && r < ti->nregs; r++) {
+    PrintReload(ti, UnboxedDefinition(ti, pc, succ, r), after[r]);
+  }
+  free(after);
+}
+
+// Writes a numeric constant as a C literal, so the C compiler can see its
+// value. Floats are printed in hexadecimal to keep all the bits.
+static const char *ConstantLiteral(const Proto *f, int idx, int as_float,
+                                   char *buf, size_t bufsize)
+{
+  const TValue *o = &f->k[idx];
+  assert(ttisnumber(o));
+  if (ttisinteger(o) && !as_float) {
+    lua_Integer n = ivalue(o);
+    if (n == LUA_MININTEGER)
+      snprintf(buf, bufsize, "LUA_MININTEGER");
+    else if (n < 0)
+      snprintf(buf, bufsize, "(" LUA_INTEGER_FMT ")", (LUAI_UACINT)n);
+    else
+      snprintf(buf, bufsize, LUA_INTEGER_FMT, (LUAI_UACINT)n);
+  } else {
+    lua_Number n = (ttisinteger(o) ? cast_num(ivalue(o)) : fltvalue(o));
+    assert(n == n); /* the parser does not fold 0/0 */
+    if (n == HUGE_VAL)
+      snprintf(buf, bufsize, "HUGE_VAL");
+    else if (n == -HUGE_VAL)
+      snprintf(buf, bufsize, "(-HUGE_VAL)");
+    else if (signbit(n))
+      snprintf(buf, bufsize, "(%a)", (double)n);
+    else
+      snprintf(buf, bufsize, "%a", (double)n);
+  }
+  return buf;
+}
+
+// A C expression for an RK operand that is known to be a number (of type t).
+// If 'as_float' is false then the operand must be an integer.
+static const char *NumberOperand(const TypeInfo *ti, int pc, int x, TypeSet t,
+                                 int as_float, char *buf, size_t bufsize)
+{
+  char ptr[32];
+  int w = (ISK(x) ? -1 : UnboxedRange(ti, pc, x));
+  if (ISK(x) && bytecode_literals) {
+    return ConstantLiteral(ti->f, INDEXK(x), as_float, buf, bufsize);
+  } else if (ISK(x)) {
+    snprintf(ptr, sizeof(ptr), "k + %d", INDEXK(x));
+  } else if (w >= 0) {
+    const char *name = UnboxedName(ti, w);
+    if (as_float && ti->unboxed[w] == T_INTEGER)
+      snprintf(buf, bufsize, "cast_num(%s)", name);
+    else
+      snprintf(buf, bufsize, "%s", name);
+    return buf;
+  } else {
+    snprintf(ptr, sizeof(ptr), "base + %d", x);
+  }
+
+  if (!as_float)         snprintf(buf, bufsize, "ivalue(%s)", ptr);
+  else if (t == T_INTEGER) snprintf(buf, bufsize, "cast_num(ivalue(%s))", ptr);
+  else if (t == T_FLOAT)   snprintf(buf, bufsize, "fltvalue(%s)", ptr);
+  else                   snprintf(buf, bufsize, "nvalue(%s)", ptr);
+  return buf;
+}
+
+// Assigns a number to a register in the instruction at pc, which may or may
+// not be unboxed. 'dst' is the address of the register in the stack.
+static void PrintSetRegister(const TypeInfo *ti, int pc, int r, const char *dst,
+                             int is_float, const char *expr)
+{
+  TypeSet t = (is_float ? T_FLOAT : T_INTEGER);
+  int w = UnboxedDefinition(ti, pc, pc + 1, r);
+  if (w >= 0 && ti->unboxed[w] == t) {
+    PP_writeln(&pp, "%s = %s;", UnboxedName(ti, w), expr);
+  } else {
+    PP_writeln(&pp, "set%svalue(%s, %s);", (is_float ? "flt" : "i"), dst, expr);
+  }
+}
+
+#define PrintSetNumber(ti,pc,a,is_float,expr) PrintSetRegister(ti, pc, a, "ra", is_float, expr)
+
+static int IsArith(OpCode o)
+{
+  return (OP_ADD <= o && o <= OP_SHR);
+}
+
+static int IsBitwise(OpCode o)
+{
+  return (o == OP_BAND || o == OP_BOR || o == OP_BXOR ||
+          o == OP_SHL || o == OP_SHR);
+}
+
+// Can we emit the specialized version of a binary arithmetic operator?
+static int CanSpecializeArith(OpCode o, TypeSet tb, TypeSet tc)
+{
+  if ((tb | tc) & T_OTHER) return 0;
+  if (IsBitwise(o)) return (tb == T_INTEGER && tc == T_INTEGER);
+  return 1;
+}
+
+// Are both operands of this comparison known to be numbers of the same kind?
+// Then we can compare them with a plain C operator.
+static int CanSpecializeCompare(const TypeInfo *ti, int pc)
+{
+  Instruction i = ti->f->code[pc];
+  TypeSet tb = RKType(ti, REGTYPES(ti, pc), GETARG_B(i));
+  TypeSet tc = RKType(ti, REGTYPES(ti, pc), GETARG_C(i));
+  return (tb == tc && (tb == T_INTEGER || tb == T_FLOAT));
+}
+
+// Does the code for this instruction use the unboxed registers directly,
+// instead of reading them from the stack?
+static int ReadsUnboxed(const TypeInfo *ti, int pc)
+{
+  Instruction i = ti->f->code[pc];
+  OpCode o = GET_OPCODE(i);
+  const TypeSet *types = REGTYPES(ti, pc);
+  switch (o) {
+    case OP_MOVE:
+      return 1;
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_MOD: case OP_POW:
+    case OP_DIV: case OP_IDIV: case OP_BAND: case OP_BOR: case OP_BXOR:
+    case OP_SHL: case OP_SHR:
+      return CanSpecializeArith(o, RKType(ti, types, GETARG_B(i)),
+                                   RKType(ti, types, GETARG_C(i)));
+    case OP_UNM:
+      return (types[GETARG_B(i)] == T_INTEGER || types[GETARG_B(i)] == T_FLOAT);
+    case OP_BNOT:
+      return (types[GETARG_B(i)] == T_INTEGER);
+    case OP_FORLOOP:
+      return (types[GETARG_A(i)] == T_INTEGER || types[GETARG_A(i)] == T_FLOAT);
+    case OP_EQ: case OP_LT: case OP_LE:
+      return CanSpecializeCompare(ti, pc);
+    case OP_GETTABLE: case OP_SETTABLE:
+      return (GuardedAccess(pc) >= 0);  /* and spills when the guard fails */
+    default:
+      return 0;
+  }
+}
+
+// Can this instruction look at ci->u.l.savedpc? This is the case for anything
+// that can raise an error, call a function or metamethod, or run the GC (which
+// may call finalizers). For the other instructions we don't need to keep
+// savedpc up to date (with --no-constant-propagation we always do).
+static int NeedsSavedPc(const TypeInfo *ti, int pc)
+{
+  Instruction i = ti->f->code[pc];
+  OpCode o = GET_OPCODE(i);
+  const TypeSet *types = REGTYPES(ti, pc);
+  switch (o) {
+    case OP_MOVE: case OP_LOADK: case OP_LOADKX: case OP_LOADBOOL:
+    case OP_LOADNIL: case OP_GETUPVAL: case OP_SETUPVAL: case OP_JMP:
+    case OP_TEST: case OP_TESTSET: case OP_FORLOOP: case OP_TFORLOOP:
+      return 0;
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_MOD: case OP_POW:
+    case OP_DIV: case OP_IDIV: case OP_BAND: case OP_BOR: case OP_BXOR:
+    case OP_SHL: case OP_SHR: {
+      TypeSet tb = RKType(ti, types, GETARG_B(i));
+      TypeSet tc = RKType(ti, types, GETARG_C(i));
+      if (!CanSpecializeArith(o, tb, tc)) return 1;
+      /* integer division and modulo by zero raise an error */
+      return ((o == OP_MOD || o == OP_IDIV) && tb != T_FLOAT && tc != T_FLOAT);
+    }
+    case OP_UNM: case OP_BNOT:
+    case OP_EQ: case OP_LT: case OP_LE:
+      return !ReadsUnboxed(ti, pc);
+    default:
+      return 1;
+  }
+}
+
+// Emits a statement that moves savedpc along with the control flow, at the
+// current indentation. These are unnecessary if we set savedpc before the
+// instructions that need it.
+static void PrintSavedPcUpdate(const char *stmt)
+{
+  if (!lazy_savedpc) PP_writeln(&pp, "%s", stmt);
+}
+
+// Specialized code for the binary arithmetic operators, for when both operands
+// are known to be numbers of types tb and tc.
+static int PrintNumberArith(const TypeInfo *ti, int pc, TypeSet tb, TypeSet tc)
+{
+  Instruction i = ti->f->code[pc];
+  OpCode o = GET_OPCODE(i);
+  int a = GETARG_A(i);
+  int b = GETARG_B(i);
+  int c = GETARG_C(i);
+
+  const char *iop = NULL;  /* integer version */
+  const char *fop = NULL;  /* float version */
+  switch (o) {
+    case OP_ADD:  iop = "intop(+, ib, ic)";      fop = "luai_numadd(L, nb, nc)"; break;
+    case OP_SUB:  iop = "intop(-, ib, ic)";      fop = "luai_numsub(L, nb, nc)"; break;
+    case OP_MUL:  iop = "intop(*, ib, ic)";      fop = "luai_nummul(L, nb, nc)"; break;
+    case OP_MOD:  iop = "luaV_mod(L, ib, ic)";   fop = NULL; break;
+    case OP_IDIV: iop = "luaV_div(L, ib, ic)";   fop = "luai_numidiv(L, nb, nc)"; break;
+    case OP_DIV:  iop = NULL;                    fop = "luai_numdiv(L, nb, nc)"; break;
+    case OP_POW:  iop = NULL;                    fop = "luai_numpow(L, nb, nc)"; break;
+    case OP_BAND: iop = "intop(&, ib, ic)";      fop = NULL; break;
+    case OP_BOR:  iop = "intop(|, ib, ic)";      fop = NULL; break;
+    case OP_BXOR: iop = "intop(^, ib, ic)";      fop = NULL; break;
+    case OP_SHL:  iop = "luaV_shiftl(ib, ic)";   fop = NULL; break;
+    case OP_SHR:  iop = "luaV_shiftl(ib, -ic)";  fop = NULL; break;
+    default: return 0;
+  }
+
+  assert(CanSpecializeArith(o, tb, tc));
+
+  int only_int = (iop && tb == T_INTEGER && tc == T_INTEGER);
+  int may_be_int = (iop && tb != T_FLOAT && tc != T_FLOAT);
+
+  char eb[64], ec[64];
+
+  if (may_be_int) {
+    if (!only_int) {
+      PP_begin_line(&pp);
+      PP_write(&pp, "if (");
+      if (tb != T_INTEGER) PP_write(&pp, "ttisinteger(base + %d)", b);
+      if (tb != T_INTEGER && tc != T_INTEGER) PP_write(&pp, " && ");
+      if (tc != T_INTEGER) PP_write(&pp, "ttisinteger(base + %d)", c);
+      PP_write(&pp, ") {");
+      PP_end_line(&pp);
+      PP_indent(&pp);
+    }
+    PP_writeln(&pp, "lua_Integer ib = %s;", NumberOperand(ti, pc, b, T_INTEGER, 0, eb, sizeof(eb)));
+    PP_writeln(&pp, "lua_Integer ic = %s;", NumberOperand(ti, pc, c, T_INTEGER, 0, ec, sizeof(ec)));
+    PrintSetNumber(ti, pc, a, 0, iop);
+    if (only_int) return 1;
+    PP_dedent(&pp);
+    PP_writeln(&pp, "}");
+    PP_writeln(&pp, "else {"); PP_indent(&pp);
+  }
+
+  PP_writeln(&pp, "lua_Number nb = %s;", NumberOperand(ti, pc, b, tb, 1, eb, sizeof(eb)));
+  PP_writeln(&pp, "lua_Number nc = %s;", NumberOperand(ti, pc, c, tc, 1, ec, sizeof(ec)));
+  if (o == OP_MOD) {
+    PP_writeln(&pp, "lua_Number m;");
+    PP_writeln(&pp, "luai_nummod(L, nb, nc, m);");
+    PrintSetNumber(ti, pc, a, 1, "m");
+  } else {
+    PrintSetNumber(ti, pc, a, 1, fop);
+  }
+
+  if (may_be_int) {
+    PP_dedent(&pp); PP_writeln(&pp, "}");
+  }
+  return 1;
+}
+
+static const char *const arith_op_names[] = {
+  "LUA_OPADD", "LUA_OPSUB", "LUA_OPMUL", "LUA_OPMOD", "LUA_OPPOW", "LUA_OPDIV",
+  "LUA_OPIDIV", "LUA_OPBAND", "LUA_OPBOR", "LUA_OPBXOR", "LUA_OPSHL", "LUA_OPSHR",
+};
+
+// Specialized code for the binary arithmetic operators. If we don't know the
+// types of both operands, but one of them is a numeric constant or the profile
+// says that the operands were always numbers, we can still use the specialized
+// code after checking the types of the register operands. In the rare case
+// that the check fails, luaO_arith does the same as the generic code (string
+// coercions and metamethods). Returns 0 if the types are not known well enough
+// and we need to fall back to the generic version.
+static int PrintTypedArith(const TypeInfo *ti, int pc)
+{
+  Instruction i = ti->f->code[pc];
+  OpCode o = GET_OPCODE(i);
+  int b = GETARG_B(i);
+  int c = GETARG_C(i);
+  TypeSet tb = RKType(ti, REGTYPES(ti, pc), b);
+  TypeSet tc = RKType(ti, REGTYPES(ti, pc), c);
+
+  if (!IsArith(o)) return 0;
+  if (CanSpecializeArith(o, tb, tc)) return PrintNumberArith(ti, pc, tb, tc);
+
+  TypeSet want;  /* what we expect the register operands to be */
+  int seen = ProfileSeen(pc);
+  if (seen != 0 && !(seen & ZZ_SEEN_OTHER)) {
+    want = (seen == ZZ_SEEN_INTEGER ? T_INTEGER : T_NUMBER);
+  } else if (bytecode_literals && ISK(b) != ISK(c)) {
+    TypeSet tk = (ISK(b) ? tb : tc);
+    if (tk != T_INTEGER && tk != T_FLOAT) return 0;
+    want = (IsBitwise(o) ? T_INTEGER : T_NUMBER);
+  } else {
+    return 0;
+  }
+
+  TypeSet gb = (ISK(b) ? tb : tb & want);
+  TypeSet gc = (ISK(c) ? tc : tc & want);
+  if (!gb || !gc || !CanSpecializeArith(o, gb, gc)) return 0;
+
+  PP_begin_line(&pp);
+  PP_write(&pp, "if (zz_likely(");
+  int nguards = 0;
+  for (int n = 0; n < 2; n++) {
+    int x = (n == 0 ? b : c);
+    TypeSet t = (n == 0 ? tb : tc), g = (n == 0 ? gb : gc);
+    if (t == g) continue;
+    PP_write(&pp, "%s%s(base + %d)", (nguards++ ? " && " : ""),
+             (g == T_INTEGER ? "ttisinteger" : g == T_FLOAT ? "ttisfloat" : "ttisnumber"), x);
+  }
+  PP_write(&pp, ")) {");
+  PP_end_line(&pp);
+  PP_indent(&pp);
+  PrintNumberArith(ti, pc, gb, gc);
+  PP_dedent(&pp);
+  PP_writeln(&pp, "}");
+  PP_writeln(&pp, "else { Protect(zz_arith(L, %s, RKB(i), RKC(i), ra)); }",
+             arith_op_names[o - OP_ADD]);
+  return 1;
+}
+
+
+// Computes 'cmp' for OP_EQ, OP_LT and OP_LE. Operands with a known type don't
+// need a tag check, and constants are compared as literals. The fast paths
+// cover integers and floats (and short strings for OP_EQ); anything else goes
+// to the functions from lvm.c, which may call metamethods.
+static void PrintComparison(const TypeInfo *ti, int pc)
+{
+  Instruction i = ti->f->code[pc];
+  OpCode o = GET_OPCODE(i);
+  int b = GETARG_B(i);
+  int c = GETARG_C(i);
+  TypeSet tb = RKType(ti, REGTYPES(ti, pc), b);
+  TypeSet tc = RKType(ti, REGTYPES(ti, pc), c);
+
+  const char *iop, *fop, *generic;
+  switch (o) {
+    case OP_EQ: iop = "=="; fop = "luai_numeq"; generic = "luaV_equalobj"; break;
+    case OP_LT: iop = "<";  fop = "luai_numlt"; generic = "luaV_lessthan"; break;
+    case OP_LE: iop = "<="; fop = "luai_numle"; generic = "luaV_lessequal"; break;
+    default: assert(0); return;
+  }
+
+  PP_writeln(&pp, "int cmp;");
+
+  if (o == OP_EQ && ISK(b) != ISK(c)) {
+    /* Comparing with a constant that is not a number never calls __eq. */
+    int x = (ISK(b) ? c : b);
+    const TValue *kv = &ti->f->k[INDEXK(ISK(b) ? b : c)];
+    if (ttisnil(kv)) {
+      PP_writeln(&pp, "cmp = ttisnil(base + %d);", x);
+      return;
+    } else if (ttisboolean(kv)) {
+      PP_writeln(&pp, "cmp = ttisboolean(base + %d) && bvalue(base + %d) == %d;",
+                 x, x, bvalue(kv));
+      return;
+    } else if (ttisshrstring(kv)) {
+      PP_writeln(&pp, "cmp = ttisshrstring(base + %d) && eqshrstr(tsvalue(base + %d), tsvalue(k + %d));",
+                 x, x, INDEXK(ISK(b) ? b : c));
+      return;
+    }
+  }
+
+  char eb[64], ec[64];
+
+  if (CanSpecializeCompare(ti, pc)) {
+    int is_float = (tb == T_FLOAT);
+    NumberOperand(ti, pc, b, tb, is_float, eb, sizeof(eb));
+    NumberOperand(ti, pc, c, tc, is_float, ec, sizeof(ec));
+    if (is_float)
+      PP_writeln(&pp, "cmp = %s(%s, %s);", fop, eb, ec);
+    else
+      PP_writeln(&pp, "cmp = (%s %s %s);", eb, iop, ec);
+    return;
+  }
+
+  /* Try both operands as integers, then both as floats */
+  int first = 1;
+  for (int is_float = 0; is_float <= 1; is_float++) {
+    TypeSet t = (is_float ? T_FLOAT : T_INTEGER);
+    if (!(tb & t) || !(tc & t)) continue;
+    const char *tag = (is_float ? "ttisfloat" : "ttisinteger");
+    PP_begin_line(&pp);
+    PP_write(&pp, "%sif (", (first ? "" : "else "));
+    if (tb != t) PP_write(&pp, "%s(base + %d)", tag, b);
+    if (tb != t && tc != t) PP_write(&pp, " && ");
+    if (tc != t) PP_write(&pp, "%s(base + %d)", tag, c);
+    PP_write(&pp, ") {");
+    PP_end_line(&pp);
+    NumberOperand(ti, pc, b, t, is_float, eb, sizeof(eb));
+    NumberOperand(ti, pc, c, t, is_float, ec, sizeof(ec));
+    if (is_float)
+      PP_writeln(&pp, "  cmp = %s(%s, %s);", fop, eb, ec);
+    else
+      PP_writeln(&pp, "  cmp = (%s %s %s);", eb, iop, ec);
+    PP_writeln(&pp, "}");
+    first = 0;
+  }
+  if (o == OP_EQ && !ISK(b) && !ISK(c) && (tb & T_OTHER) && (tc & T_OTHER)) {
+    PP_writeln(&pp, "%sif (ttisshrstring(base + %d) && ttisshrstring(base + %d)) {",
+               (first ? "" : "else "), b, c);
+    PP_writeln(&pp, "  cmp = eqshrstr(tsvalue(base + %d), tsvalue(base + %d));", b, c);
+    PP_writeln(&pp, "}");
+    first = 0;
+  }
+  PP_writeln(&pp, "%s{ Protect(cmp = %s(L, RKB(i), RKC(i))); }", (first ? "" : "else "), generic);
+}
+
+// Calls the line and count hooks before the instruction at pc, if there are
+// any. If 'savedpc' is not NULL, we first have to set ci->u.l.savedpc to it.
+// The hook runs before the instruction, so it sees all the unboxed registers
+// (ZZ_SPILL leaves out the ones that the instruction assigns to) and may
+// change the live ones.
+static void PrintHookCheck(const TypeInfo *ti, int pc, const char *savedpc)
+{
+  PP_writeln(&pp, "if (zz_unlikely(L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT))) {");
+  PP_indent(&pp);
+  if (savedpc)
+    PP_writeln(&pp, "ci->u.l.savedpc = %s;", savedpc);
+  PrintSpills(ti, pc, NULL);
+  PP_writeln(&pp, "Protect(zz_traceexec(L));");
+  for (int r = 0; r < ti->nregs; r++) {
+    int w = UnboxedRange(ti, pc, r);
+    if (w >= 0 && ti->live[pc * ti->nregs + r]) PrintCheckedReload(ti, w, "");
+  }
+  PP_dedent(&pp);
+  PP_writeln(&pp, "}");
+}
+
+// The start of the code that skips the OP_JMP after a test. If the profile
+// says that the test always went the same way, we tell the C compiler.
+static void PrintSkipJmp(int pc, const char *cond)
+{
+  int seen = ProfileSeen(pc);
+  if (seen == ZZ_SEEN_NOJUMP)
+    PP_writeln(&pp, "if (zz_likely(%s)) {", cond);
+  else if (seen == ZZ_SEEN_JUMP)
+    PP_writeln(&pp, "if (zz_unlikely(%s)) {", cond);
+  else
+    PP_writeln(&pp, "if (%s) {", cond);
+}
+
+// OP_EQ, OP_LT, OP_LE, OP_TEST and OP_TESTSET are always followed by an OP_JMP
+// that is executed if the test succeeds. We emit that jump together with the
+// test, so that the C compiler sees a single conditional branch to the target.
+// The hook check and savedpc update of the OP_JMP are kept.
+static void PrintFusedJmp(const TypeInfo *ti, int pc, const char *polls_hooks)
+{
+  const Proto *f = ti->f;
+  int jpc = pc + 1;
+  assert(jpc < f->sizecode);
+  Instruction j = f->code[jpc];
+  assert(GET_OPCODE(j) == OP_JMP);
+  int a = GETARG_A(j);
+  int target = jpc + 1 + GETARG_sBx(j);
+
+  PP_writeln(&pp, "/* JMP */");
+  PrintSavedPcUpdate("ci->u.l.savedpc++;");
+  if (polls_hooks[jpc]) {
+    char savedpc[32];
+    snprintf(savedpc, sizeof(savedpc), "code + %d", RealPc(jpc)+1);
+    PrintHookCheck(ti, jpc, lazy_savedpc ? savedpc : NULL);
+  }
+  if (a != 0) PP_writeln(&pp, "luaF_close(L, base + %d);", a - 1);
+  if (!lazy_savedpc) PP_writeln(&pp, "ci->u.l.savedpc += %d;", GETARG_sBx(j));
+  PP_writeln(&pp, "goto label_%d;", target);
+}
+
+// The control flow of the generated C code. It is the same as the control flow
+// of the bytecode (see Successors), except that the OP_JMP after a test is
+// merged into the test (see PrintFusedJmp). Fills in the labels that the code
+// for this instruction jumps to and returns how many there are. Sets
+// *falls_through if the code can continue to the following instruction.
+static int CodeSuccessors(const Proto *f, int pc, int *targets, int *falls_through)
+{
+  Instruction i = f->code[pc];
+  *falls_through = 0;
+  switch (GET_OPCODE(i)) {
+    case OP_JMP:
+      targets[0] = pc + 1 + GETARG_sBx(i);
+      return 1;
+    case OP_FORPREP:
+      targets[0] = pc + 1 + GETARG_sBx(i);
+      if (!FloatEntry(pc)) return 1;
+      targets[1] = FloatEntry(pc);
+      return 2;
+    case OP_FORLOOP:
+      targets[0] = pc + 1 + GETARG_sBx(i);
+      if (LoopExit(pc) != pc + 1) {
+        targets[1] = LoopExit(pc);
+        return 2;
+      }
+      *falls_through = 1;
+      return 1;
+    case OP_TFORLOOP:
+      targets[0] = pc + 1 + GETARG_sBx(i);
+      *falls_through = 1;
+      return 1;
+    case OP_EQ: case OP_LT: case OP_LE:
+    case OP_TEST: case OP_TESTSET: {
+      Instruction j = f->code[pc+1];
+      targets[0] = pc + 2;
+      targets[1] = pc + 2 + GETARG_sBx(j);
+      return 2;
+    }
+    case OP_LOADBOOL:
+      if (!GETARG_C(i)) break;
+      targets[0] = pc + 2;
+      return 1;
+    case OP_LOADKX:
+      targets[0] = pc + 2;
+      return 1;
+    case OP_SETLIST:
+      if (GETARG_C(i)) break;
+      targets[0] = pc + 2;
+      return 1;
+    case OP_RETURN:
+      return 0;
+    default:
+      break;
+  }
+  *falls_through = 1;
+  return 0;
+}
+
+// Finds out which instructions are reachable in the generated code and which
+// of them need a label, because there is a goto to them.
+static void AnalyzeLabels(const Proto *f, char *live, char *is_label)
+{
+  int n = f->sizecode;
+  int *stack = malloc(n * sizeof(int));
+  if (!stack) fatal("out of memory");
+  memset(live, 0, n);
+  memset(is_label, 0, n);
+
+  int top = 0;
+  live[0] = 1;
+  stack[top++] = 0;
+  while (top > 0) {
+    int pc = stack[--top];
+    int targets[2], falls_through;
+    int ntargets = CodeSuccessors(f, pc, targets, &falls_through);
+    for (int t = 0; t < ntargets + falls_through; t++) {
+      int next = (t < ntargets ? targets[t] : pc + 1);
+      assert(0 <= next && next < n);
+      if (t < ntargets) is_label[next] = 1;
+      if (!live[next]) {
+        live[next] = 1;
+        stack[top++] = next;
+      }
+    }
+  }
+  free(stack);
+}
+
+/*
+** Call target prediction
+** ======================
+**
+** All the functions of the input modules end up in the same C file, so when
+** one of them calls another we could call the C function directly instead of
+** going through the Proto. We look at the main chunk of each module for the
+** functions it stores in a table field or in a global ("function M.foo()",
+** "function foo()", "return { foo = foo }"), and at each call site for the
+** name of the field that the callee came from. If only one function was
+** stored under that name, we guess that it is the one being called. Calls to
+** local functions that are upvalues (including recursive calls) are resolved
+** by looking at the enclosing function.
+**
+** This is only a guess: the generated code checks it on every call (see
+** zz_precall_direct), so nothing breaks if the program does something else.
+** For the same reason we don't bother with control flow when looking for the
+** instruction that last wrote to a register.
+*/
+
+typedef struct {
+  const char *name;
+  int id;    /* ID of the magic function, or -1 if there are several */
+} Export;
+
+static Export *exports;
+static int nexports = 0;
+
+// Numbers the functions in depth-first order, like luac prints them.
+static void NumberFunctions(const Proto *f, const Proto *parent)
+{
+  protos = realloc(protos, (nprotos + 1) * sizeof(const Proto *));
+  parents = realloc(parents, (nprotos + 1) * sizeof(const Proto *));
+  if (!protos || !parents) fatal("out of memory");
+  protos[nprotos] = f;
+  parents[nprotos] = parent;
+  nprotos++;
+  for (int i = 0; i < f->sizep; i++) {
+    NumberFunctions(f->p[i], f);
+  }
+}
+
+static int FunctionId(const Proto *f)
+{
+  for (int id = 0; id < nprotos; id++) {
+    if (protos[id] == f) return id;
+  }
+  return -1;
+}
+
+// Does the instruction at pc (maybe) change register r?
+static int WritesRegister(const Proto *f, int pc, int r)
+{
+  Instruction i = f->code[pc];
+  OpCode o = GET_OPCODE(i);
+  int a = GETARG_A(i);
+  switch (o) {
+    case OP_LOADNIL:
+      return a <= r && r <= a + GETARG_B(i);
+    case OP_SELF:
+      return r == a || r == a + 1;
+    case OP_CONCAT:
+      return r == a || r >= GETARG_B(i);
+    case OP_CALL:
+    case OP_TAILCALL:
+    case OP_VARARG:
+      return r >= a;
+    case OP_TFORCALL:
+      return r >= a + 3;
+    case OP_FORLOOP:
+      return r == a || r == a + 3;
+    default:
+      return testAMode(o) && r == a;
+  }
+}
+
+static int LastWrite(const Proto *f, int pc, int r)
+{
+  while (--pc >= 0) {
+    if (WritesRegister(f, pc, r)) return pc;
+  }
+  return -1;
+}
+
+// The function that was stored in register r before pc, if any.
+static const Proto *ClosureIn(const Proto *f, int pc, int r)
+{
+  while ((pc = LastWrite(f, pc, r)) >= 0) {
+    Instruction i = f->code[pc];
+    switch (GET_OPCODE(i)) {
+      case OP_CLOSURE:
+        return f->p[GETARG_Bx(i)];
+      case OP_MOVE:
+        r = GETARG_B(i);
+        break;
+      default:
+        return NULL;
+    }
+  }
+  return NULL;
+}
+
+static void AddExport(const char *name, int id)
+{
+  for (int e = 0; e < nexports; e++) {
+    if (0 == strcmp(exports[e].name, name)) {
+      if (exports[e].id != id) exports[e].id = -1;
+      return;
+    }
+  }
+  exports = realloc(exports, (nexports + 1) * sizeof(Export));
+  if (!exports) fatal("out of memory");
+  exports[nexports].name = name;
+  exports[nexports].id = id;
+  nexports++;
+}
+
+// The string constant in an RK operand, if it looks like a Lua identifier
+// (so it is also safe to put in a C comment). NULL otherwise.
+static const char *StringConstant(const Proto *f, int x)
+{
+  if (!ISK(x) || !ttisstring(&f->k[INDEXK(x)])) return NULL;
+  const char *s = getstr(tsvalue(&f->k[INDEXK(x)]));
+  for (const char *c = s; *c != '\0'; c++) {
+    if (! (isalnum(*c) || *c == '_')) return NULL;
+  }
+  return s;
+}
+
+static void FindExports(const Proto *f)
+{
+  for (int pc = 0; pc < f->sizecode; pc++) {
+    Instruction i = f->code[pc];
+    OpCode o = GET_OPCODE(i);
+    if (o != OP_SETTABLE && o != OP_SETTABUP) continue;
+    const char *name = StringConstant(f, GETARG_B(i));
+    if (!name || ISK(GETARG_C(i))) continue;
+    const Proto *p = ClosureIn(f, pc, GETARG_C(i));
+    if (p) AddExport(name, FunctionId(p));
+  }
+}
+
+// Our guess for the function called by the OP_CALL at pc (-1 if none).
+static int PredictCallee(const Proto *f, int pc, const char **name)
+{
+  int r = GETARG_A(f->code[pc]);
+  int w = LastWrite(f, pc, r);
+  if (w < 0) return -1;
+
+  Instruction i = f->code[w];
+  int id = -1;
+  switch (GET_OPCODE(i)) {
+    case OP_GETTABLE:
+    case OP_GETTABUP:
+    case OP_SELF: {
+      *name = StringConstant(f, GETARG_C(i));
+      if (!*name) return -1;
+      for (int e = 0; e < nexports; e++) {
+        if (0 == strcmp(exports[e].name, *name)) id = exports[e].id;
+      }
+    } break;
+    case OP_GETUPVAL: {
+      // Find where the enclosing function created us
+      const Upvaldesc *uv = &f->upvalues[GETARG_B(i)];
+      const Proto *parent = parents[FunctionId(f)];
+      if (!uv->instack || !parent) return -1;
+      for (int ppc = 0; ppc < parent->sizecode; ppc++) {
+        Instruction pi = parent->code[ppc];
+        if (GET_OPCODE(pi) == OP_CLOSURE && parent->p[GETARG_Bx(pi)] == f) {
+          const Proto *p = ClosureIn(parent, ppc + 1, uv->idx);
+          if (p) id = FunctionId(p);
+          break;
+        }
+      }
+      *name = uv->name ? getstr(uv->name) : "?";
+    } break;
+    default:
+      return -1;
+  }
+
+  if (id < 0 || protos[id]->is_vararg || !compiled[id]) return -1;
+  return id;
+}
+
+/*
+** Splitting large functions
+** =========================
+**
+** The C compiler takes a long time (worse than linear) to optimize a huge C
+** function full of gotos, and the result isn't even good. So we split
+** functions with more than split_threshold instructions into parts, each in
+** its own C function. When the code of one part jumps to an instruction in
+** another part, it writes all the registers back to the Lua stack and
+** returns the pc of the instruction, and a small loop in the function proper
+** calls the part with that instruction. We don't use C tail calls for this
+** because without optimizations they would eat up the C stack.
+**
+** We try to split at the start of a basic block where no register is kept
+** in a C local, so that nothing has to be reloaded on the other side.
+*/
+
+static int FallsInto(const Proto *f, const char *live, int pc)
+{
+  int prev = pc - 1;
+  while (prev >= 0 && !live[prev]) prev--;
+  if (prev < 0) return 0;
+  int targets[2], falls_through;
+  CodeSuccessors(f, prev, targets, &falls_through);
+  return falls_through;
+}
+
+static int HasUnboxedValues(const TypeInfo *ti, int pc)
+{
+  const TypeSet *types = REGTYPES(ti, pc);
+  for (int r = 0; r < ti->nregs; r++) {
+    int w = UnboxedRange(ti, pc, r);
+    if (w >= 0 && types[r] == ti->unboxed[w]) return 1;
+  }
+  return 0;
+}
+
+static int PartOf(const int *part_start, int nparts, int pc)
+{
+  int part = 0;
+  while (part + 1 < nparts && part_start[part+1] <= pc) part++;
+  return part;
+}
+
+// Chooses where each part starts (part_start[nparts] is the end) and marks
+// the instructions that are reached from other parts. Returns the number of
+// parts, which is 1 for functions that are not split.
+static int SplitFunction(const TypeInfo *ti, const char *live, const char *is_label,
+                         int *part_start, char *is_entry)
+{
+  const Proto *f = ti->f;
+  int n = f->sizecode;
+  int nparts = 1;
+  part_start[0] = 0;
+
+  if (split_threshold > 0) {
+    while (n - part_start[nparts-1] > split_threshold) {
+      int candidate = part_start[nparts-1] + split_threshold;
+      int block_start = -1, clean_start = -1;
+      for (int pc = candidate; pc > candidate - split_threshold / 4; pc--) {
+        if (!live[pc] || (!is_label[pc] && FallsInto(f, live, pc))) continue;
+        if (block_start < 0) block_start = pc;
+        if (!HasUnboxedValues(ti, pc)) { clean_start = pc; break; }
+      }
+      if (clean_start < 0 && block_start < 0) {
+        while (candidate < n && !live[candidate]) candidate++;
+        if (candidate == n) break;  /* the rest is dead code */
+      }
+      part_start[nparts++] = (clean_start >= 0 ? clean_start :
+                              block_start >= 0 ? block_start : candidate);
+    }
+  }
+  part_start[nparts] = n;
+
+  memset(is_entry, 0, n);
+  if (nparts == 1) return 1;
+  for (int pc = 0; pc < n; pc++) {
+    if (!live[pc]) continue;
+    int targets[2], falls_through;
+    int ntargets = CodeSuccessors(f, pc, targets, &falls_through);
+    if (falls_through) targets[ntargets++] = pc + 1;
+    for (int t = 0; t < ntargets; t++) {
+      if (PartOf(part_start, nparts, targets[t]) != PartOf(part_start, nparts, pc))
+        is_entry[targets[t]] = 1;
+    }
+  }
+  return nparts;
+}
+
+// Like AnalyzeLabels, but for a part: it only needs labels for the jumps that
+// stay inside the part and for the entries that PrintPartEntry jumps to.
+static void AnalyzePartLabels(const Proto *f, const char *live, const char *is_entry,
+                              int start, int end, char *is_label)
+{
+  memset(is_label, 0, f->sizecode);
+  for (int pc = start; pc < end; pc++) {
+    if (!live[pc]) continue;
+    if (is_entry[pc] && pc != start) is_label[pc] = 1;
+    int targets[2], falls_through;
+    int ntargets = CodeSuccessors(f, pc, targets, &falls_through);
+    for (int t = 0; t < ntargets; t++) {
+      if (start <= targets[t] && targets[t] < end) is_label[targets[t]] = 1;
+    }
+  }
+}
+
+static void PrintPartReloads(const TypeInfo *ti, int pc)
+{
+  const TypeSet *types = REGTYPES(ti, pc);
+  for (int r = 0; r < ti->nregs; r++) {
+    PrintReload(ti, UnboxedRange(ti, pc, r), types[r]);
+  }
+}
+
+// Jumps to the instruction where the part should start running
+static void PrintPartEntry(const TypeInfo *ti, int start, int end, const char *is_entry)
+{
+  PP_writeln(&pp, "int entry = *next;");
+  PP_writeln(&pp, "*next = -1;  /* unless we jump to another part */");
+  int nentries = 0;
+  for (int pc = start + 1; pc < end; pc++) {
+    if (!is_entry[pc]) continue;
+    if (nentries++ == 0) PP_writeln(&pp, "switch (entry) {");
+    PP_writeln(&pp, "  case %d:", pc);
+    PP_indent(&pp); PP_indent(&pp);
+    PrintPartReloads(ti, pc);
+    PP_writeln(&pp, "goto label_%d;", pc);
+    PP_dedent(&pp); PP_dedent(&pp);
+  }
+  if (nentries > 0)
+    PP_writeln(&pp, "}");
+  else
+    PP_writeln(&pp, "(void) entry;");
+  PrintPartReloads(ti, start);
+  PP_writeln(&pp, "");
+}
+
+// Leaves the part, to continue at pc in another part
+static void PrintPartExit(const TypeInfo *ti, int pc, int is_label)
+{
+  if (is_label)
+    PP_writeln(&pp, "label_%d: {", pc);
+  else
+    PP_writeln(&pp, "{");
+  PP_indent(&pp);
+  PrintSpills(ti, pc, NULL);
+  PP_writeln(&pp, "*next = %d; return 0;", pc);
+  PP_dedent(&pp);
+  PP_writeln(&pp, "}");
+}
+
+// The targets of the jumps that leave the part
+static void PrintPartExits(const TypeInfo *ti, const char *live, int start, int end)
+{
+  const Proto *f = ti->f;
+  char *exits = calloc(f->sizecode + 1, 1);
+  if (!exits) fatal("out of memory");
+  int falls_off = 0;
+  for (int pc = start; pc < end; pc++) {
+    if (!live[pc]) continue;
+    int targets[2], falls_through;
+    int ntargets = CodeSuccessors(f, pc, targets, &falls_through);
+    for (int t = 0; t < ntargets; t++) {
+      if (targets[t] < start || targets[t] >= end) exits[targets[t]] = 1;
+    }
+    if (falls_through && pc + 1 == end) falls_off = 1;
+  }
+
+  if (falls_off) {
+    PrintPartExit(ti, end, exits[end]);
+    exits[end] = 0;
+  }
+  for (int pc = 0; pc < f->sizecode; pc++) {
+    if (exits[pc]) PrintPartExit(ti, pc, 1);
+  }
+  free(exits);
+}
+
+// Is the RK operand x a constant short string? Table accesses with such a
+// key (global variables and record fields) get an inline cache (see
+// gettableCached in luaot-generated-header.c).
+static int IsShortStringConstant(const Proto *f, int x)
+{
+  return ISK(x) && ttisshrstring(&f->k[INDEXK(x)]);
+}
+
+/*
+** Array accesses in loops
+** =======================
+**
+** In a loop like 'for i = 1, n do a[i] = a[i] + 1 end' every access checks
+** that 'a' is a table without a metatable and that 'i' is inside its array
+** part. If the body does not assign to 'a' or 'i' and has no calls, these
+** checks give the same answer in every iteration, unless something runs Lua
+** code (a metamethod, a hook or a finalizer) that changes the table. So the
+** FORPREP checks the tables once, for the first and the last value of the
+** index (which cannot wrap around), and stores the answer in a C flag
+** ('guard_N', N being the pc of the FORPREP). While the flag is set, the
+** accesses in the body go straight to the array part. Metamethods and hooks
+** only run inside a Protect, and in the body ZZ_SPILL also clears the flag,
+** so the rest of the loop falls back to the usual accesses. Finalizers can
+** also run in the GC step ('checkGC') of NEWTABLE, CONCAT and CLOSURE, which
+** is not in a Protect, so loops with those instructions are not guarded.
+*/
+
+static int *guarded_loop;    /* guarded_loop[pc]: innermost loop with a guard that has pc */
+static int *guarded_access;  /* guarded_access[pc]: loop whose guard covers the access at pc */
+
+static int GuardedLoop(int pc)
+{
+  return (guarded_loop ? guarded_loop[pc] : -1);
+}
+
+static int GuardedAccess(int pc)
+{
+  return (guarded_access ? guarded_access[pc] : -1);
+}
+
+// The table of a GETTABLE or SETTABLE with register 'key' as the key (-1 if
+// the instruction is something else)
+static int IndexedTable(const Proto *f, int pc, int key)
+{
+  Instruction i = f->code[pc];
+  switch (GET_OPCODE(i)) {
+    case OP_GETTABLE: return (GETARG_C(i) == key ? GETARG_B(i) : -1);
+    case OP_SETTABLE: return (GETARG_B(i) == key ? GETARG_A(i) : -1);
+    default: return -1;
+  }
+}
+
+// Marks the accesses that the guard of the loop of the FORPREP at pc can
+// cover. Returns 0 if there are none, or if the loop is not suitable.
+static int FindGuardedAccesses(const TypeInfo *ti, int pc)
+{
+  const Proto *f = ti->f;
+  Instruction i = f->code[pc];
+  int a = GETARG_A(i);
+  int first = pc + 1;
+  int last = pc + 1 + GETARG_sBx(i);  /* the FORLOOP */
+  if (REGTYPES(ti, first)[a+3] != T_INTEGER) return 0;
+
+  char *written = calloc(ti->nregs, 1);
+  if (!written) fatal("out of memory");
+  int ok = 1;
+  for (int q = first; q <= last && ok; q++) {
+    if (!ti->reached[q]) continue;
+    switch (GET_OPCODE(f->code[q])) {
+      case OP_CALL: case OP_TAILCALL: case OP_TFORCALL: case OP_SETLIST:
+      case OP_NEWTABLE: case OP_CONCAT: case OP_CLOSURE:  /* (GC steps) */
+        ok = 0;
+        break;
+      default:
+        for (int r = 0; r < ti->nregs; r++) {
+          if (WritesRegister(f, q, r)) written[r] = 1;
+        }
+        if (q < last && WritesRegister(f, q, a+3)) ok = 0;
+        break;
+    }
+  }
+
+  // Only FORPREP can enter the body
+  for (int q = 0; q < f->sizecode && ok; q++) {
+    if (!ti->reached[q] || (pc <= q && q <= last)) continue;
+    int succ[2];
+    int nsucc = Successors(f, q, succ);
+    for (int s = 0; s < nsucc; s++) {
+      if (first <= succ[s] && succ[s] <= last) ok = 0;
+    }
+  }
+
+  int naccesses = 0;
+  for (int q = first; q < last && ok; q++) {
+    int t = IndexedTable(f, q, a+3);
+    if (!ti->reached[q] || t < 0 || written[t]) continue;
+    guarded_access[q] = pc;
+    naccesses++;
+  }
+  free(written);
+  return naccesses;
+}
+
+static void FindGuardedLoops(const TypeInfo *ti)
+{
+  const Proto *f = ti->f;
+  int n = f->sizecode;
+  guarded_loop = malloc(n * sizeof(int));
+  guarded_access = malloc(n * sizeof(int));
+  if (!guarded_loop || !guarded_access) fatal("out of memory");
+  for (int pc = 0; pc < n; pc++) guarded_loop[pc] = guarded_access[pc] = -1;
+
+  // Outer loops come first, so inner loops overwrite guarded_loop
+  for (int pc = 0; pc < n; pc++) {
+    Instruction i = f->code[pc];
+    if (GET_OPCODE(i) != OP_FORPREP || !ti->reached[pc]) continue;
+    if (FindGuardedAccesses(ti, pc) == 0) continue;
+    int last = pc + 1 + GETARG_sBx(i);
+    for (int q = pc + 1; q <= last; q++) guarded_loop[q] = pc;
+  }
+}
+
+static void FreeGuardedLoops()
+{
+  free(guarded_loop);
+  free(guarded_access);
+  guarded_loop = guarded_access = NULL;
+}
+
+// Does the FORPREP at pc check the tables of its loop? (The body of a loop
+// starts at pc + 1, which is past the end for the last instruction.)
+static int IsGuardedLoop(const Proto *f, int pc)
+{
+  return (pc + 1 < f->sizecode && GuardedLoop(pc + 1) == pc);
+}
+
+// Checks the tables of the loop of the FORPREP at pc, in the code for an
+// integer loop (with 'initv' and 'ilimit')
+static void PrintLoopGuard(const TypeInfo *ti, int pc)
+{
+  const Proto *f = ti->f;
+  int a = GETARG_A(f->code[pc]);
+  char *tables = calloc(ti->nregs, 1);
+  if (!tables) fatal("out of memory");
+  for (int q = pc + 1; q < f->sizecode; q++) {
+    if (guarded_access[q] == pc) tables[IndexedTable(f, q, a+3)] = 1;
+  }
+  PP_begin_line(&pp);
+  PP_write(&pp, "guard_%d = (zz_forstepfits(ilimit, ivalue(pstep))", pc);
+  for (int r = 0; r < ti->nregs; r++) {
+    if (tables[r]) PP_write(&pp, " && zz_arrayguard(base + %d, initv, ilimit)", r);
+  }
+  PP_write(&pp, ");");
+  PP_end_line(&pp);
+  free(tables);
+}
+
+static void PrintCode(const Proto* f)
+{
+  const Proto *real = f;  /* f may have copies of loops (see VersionLoops) */
+
+  PP_writeln(&pp, "// source = %s", getstr(f->source));
+  PP_writeln(&pp, "// linedefined = %d", f->linedefined);
+  PP_writeln(&pp, "// lastlinedefined = %d", f->lastlinedefined);
+  PP_writeln(&pp, "// what = %s", (f->linedefined == 0) ? "main" : "Lua");
+
+  TypeInfo ti;
+  AnalyzeTypes(&ti, f);
+  Proto vf;
+  int versioned = (bytecode_literals && VersionLoops(&ti, &vf));
+  if (versioned) {
+    FreeTypeInfo(&ti);
+    f = &vf;
+    AnalyzeTypes(&ti, f);
+  }
+  ChooseUnboxedRegisters(&ti);
+  FindGuardedLoops(&ti);
+
+  const Instruction* code=f->code;
+  int nopcodes=f->sizecode;
+
+  int nranges = (2 * nopcodes + 1) * ti.nregs;
+  int nunboxed = 0;
+  for (int w = 0; w < nranges; w++) {
+    if (ti.unboxed[w]) nunboxed++;
+  }
+
+  // What the current definitions of ZZ_SPILL and ZZ_RELOAD write back and
+  // read back (see PrintSpillMacro)
+  int *spilled = malloc((2 * ti.nregs + 1) * sizeof(int));
+  if (!spilled) fatal("out of memory");
+  for (int r = 0; r <= 2 * ti.nregs; r++) spilled[r] = -1;
+
+  char *reads = malloc(ti.nregs);
+  if (!reads) fatal("out of memory");
+
+  // With --backedge-hooks we only check for hooks at the function entry and at
+  // the targets of backwards jumps, which covers every loop.
+  char *polls_hooks = calloc(nopcodes, 1);
+  if (!polls_hooks) fatal("out of memory");
+  if (hook_polling == HOOKS_EVERY_INSTRUCTION) {
+    memset(polls_hooks, 1, nopcodes);
+  } else if (hook_polling == HOOKS_BACKEDGES) {
+    polls_hooks[0] = 1;
+    for (int pc = 0; pc < nopcodes; pc++) {
+      int succ[2];
+      int nsucc = Successors(f, pc, succ);
+      for (int s = 0; s < nsucc; s++) {
+        if (RealPc(succ[s]) <= RealPc(pc)) polls_hooks[succ[s]] = 1;
+      }
+    }
+  }
+
+  char *live = malloc(nopcodes);
+  char *is_label = malloc(nopcodes);
+  if (!live || !is_label) fatal("out of memory");
+  AnalyzeLabels(f, live, is_label);
+
+  int ndead = 0, nlabels = 0;
+  for (int pc = 0; pc < nopcodes; pc++) {
+    if (!live[pc]) ndead++;
+    if (is_label[pc]) nlabels++;
+  }
+  if (ndead > 0)
+    PP_writeln(&pp, "// %d of %d instructions are unreachable", ndead, nopcodes);
+  if (print_stats)
+    fprintf(stderr, "%s: function <%s:%d>: %d instructions, %d unreachable, %d labels\n",
+            progname, getstr(f->source), f->linedefined, nopcodes, ndead, nlabels);
+
+  // Very large functions are split into parts (see SplitFunction)
+  int *part_start = malloc((nopcodes + 1) * sizeof(int));
+  char *is_entry = calloc(nopcodes, 1);
+  if (!part_start || !is_entry) fatal("out of memory");
+  int nparts = SplitFunction(&ti, live, is_label, part_start, is_entry);
+  if (print_stats && nparts > 1)
+    fprintf(stderr, "%s: function <%s:%d>: split in %d parts\n",
+            progname, getstr(f->source), f->linedefined, nparts);
+
+  if (nparts > 1) {
+    for (int part = 0; part < nparts; part++) {
+      PP_writeln(&pp, "static int zz_magic_function_%d_part_%d (lua_State *L, LClosure *cl, int *next);",
+                 NFUNCTIONS, part);
+    }
+    PP_writeln(&pp, "");
+    PP_writeln(&pp, "ZZ_FUNC int zz_magic_function_%d (lua_State *L, LClosure *cl)", NFUNCTIONS);
+    PP_writeln(&pp, "{"); PP_indent(&pp);
+    PP_writeln(&pp, "int next = 0;  /* pc where we continue, or -1 if we returned */");
+    PP_writeln(&pp, "int ret;");
+    PP_writeln(&pp, "do {"); PP_indent(&pp);
+    for (int part = 0; part < nparts; part++) {
+      if (part == nparts - 1)
+        PP_writeln(&pp, "%sret = zz_magic_function_%d_part_%d(L, cl, &next);",
+                   (part > 0 ? "else " : ""), NFUNCTIONS, part);
+      else
+        PP_writeln(&pp, "%sif (next < %d) ret = zz_magic_function_%d_part_%d(L, cl, &next);",
+                   (part > 0 ? "else " : ""), part_start[part+1], NFUNCTIONS, part);
+    }
+    PP_dedent(&pp); PP_writeln(&pp, "} while (next >= 0);");
+    PP_writeln(&pp, "return ret;");
+    PP_dedent(&pp); PP_writeln(&pp, "}");
+    PP_writeln(&pp, "");
+  }
+
+  for (int part = 0; part < nparts; part++) {
+    int start = part_start[part];
+    int end = part_start[part+1];
+
+    if (nparts > 1)
+      PP_writeln(&pp, "static int zz_magic_function_%d_part_%d (lua_State *L, LClosure *cl, int *next)",
+                 NFUNCTIONS, part);
+    else
+      PP_writeln(&pp, "ZZ_FUNC int zz_magic_function_%d (lua_State *L, LClosure *cl)", NFUNCTIONS);
+    PP_writeln(&pp, "{"); PP_indent(&pp);
+    PP_writeln(&pp,   "CallInfo *ci = L->ci;");
+    PP_writeln(&pp,   "TValue *k = cl->p->k;");
+    PP_writeln(&pp,   "StkId base = ci->u.l.base;");
+    if (lazy_savedpc)
+      PP_writeln(&pp, "const Instruction *code = cl->p->code;");
+    PP_writeln(&pp,   "");
+    PP_writeln(&pp,   "// Avoid warnings if the function has few opcodes:");
+    PP_writeln(&pp,   "(void) ci;");
+    PP_writeln(&pp,   "(void) k;");
+    PP_writeln(&pp,   "(void) base;");
+    if (lazy_savedpc)
+      PP_writeln(&pp, "(void) code;");
+    PP_writeln(&pp,   "");
+
+    if (nunboxed > 0) {
+      PP_writeln(&pp, "// Unboxed registers:");
+      for (int w = 0; w < nranges; w++) {
+        if (!ti.unboxed[w]) continue;
+        PP_writeln(&pp, "%s %s = 0;",
+                   (ti.unboxed[w] == T_INTEGER ? "lua_Integer" : "lua_Number"),
+                   UnboxedName(&ti, w));
+        if (nparts > 1)
+          PP_writeln(&pp, "(void) %s;", UnboxedName(&ti, w));
+      }
+      PP_writeln(&pp, "");
+    }
+
+    int nguards = 0;
+    for (int pc = 0; pc < nopcodes; pc++) {
+      if (!IsGuardedLoop(f, pc)) continue;
+      if (nguards++ == 0) PP_writeln(&pp, "// Did the FORPREP check the tables of the loop?");
+      PP_writeln(&pp, "int guard_%d = 0;", pc);
+      if (nparts > 1)
+        PP_writeln(&pp, "(void) guard_%d;", pc);
+    }
+    if (nguards > 0)
+      PP_writeln(&pp, "");
+
+    if (nparts > 1) {
+      AnalyzePartLabels(f, live, is_entry, start, end, is_label);
+      PrintPartEntry(&ti, start, end, is_entry);
+    }
+
+    for (int pc=start; pc<end; pc++) {
+      if (!live[pc]) continue;
+
+      PrintSpillMacro(&ti, pc, spilled);
+      PrintOpcodeComment(real, RealPc(pc));
+
+      Instruction i = code[pc];
+      OpCode o=GET_OPCODE(i);
+      const TypeSet *types = REGTYPES(&ti, pc);
+
+      if (is_label[pc])
+        PP_writeln(&pp, "label_%d: {", pc);
+      else
+        PP_writeln(&pp, "{");
+      PP_indent(&pp);
+
+      // vmfetch
+      int sync_savedpc = (lazy_savedpc && NeedsSavedPc(&ti, pc));
+      if (bytecode_literals) {
+        PP_writeln(&pp, "Instruction i = 0x%08x;", real->code[RealPc(pc)]);
+        // PP_writeln(&pp, "assert(i == *ci->u.l.savedpc);");
+        if (sync_savedpc)
+          PP_writeln(&pp, "ci->u.l.savedpc = code + %d;", RealPc(pc)+1);
+        else
+          PrintSavedPcUpdate("ci->u.l.savedpc++;");
+      } else {
+        PP_writeln(&pp, "Instruction i = *(ci->u.l.savedpc++);");
+        // PP_writeln(&pp, "assert(i ==  0x%08x);", i);
+      }
+      if (polls_hooks[pc]) {
+        char savedpc[32];
+        snprintf(savedpc, sizeof(savedpc), "code + %d", RealPc(pc)+1);
+        PrintHookCheck(&ti, pc, lazy_savedpc && !sync_savedpc ? savedpc : NULL);
+      }
+      PP_writeln(&pp, "StkId ra = RA(i); /* WARNING: any stack reallocation invalidates 'ra' */");
+      PP_writeln(&pp, "lua_assert(base == ci->u.l.base);");
+      PP_writeln(&pp, "lua_assert(base <= L->top && L->top < L->stack + L->stacksize);");
+      PP_writeln(&pp, "");
+
+      if (ReadsUnboxed(&ti, pc)) {
+        PP_writeln(&pp, "(void) ra;");
+      } else {
+        RegistersRead(f, pc, reads);
+        PrintSpills(&ti, pc, reads);
+      }
+
+      switch (o) {
+
+        case OP_MOVE: {
+          int a = GETARG_A(i);
+          int b = GETARG_B(i);
+          int wa = UnboxedDefinition(&ti, pc, pc + 1, a);
+          if (UnboxedRange(&ti, pc, b) >= 0 || (wa >= 0 && ti.unboxed[wa] == types[b])) {
+            char eb[64];
+            int is_float = (types[b] == T_FLOAT);
+            PrintSetNumber(&ti, pc, a, is_float,
+                           NumberOperand(&ti, pc, b, types[b], is_float, eb, sizeof(eb)));
+            break;
+          }
+          PP_writeln(&pp, "setobjs2s(L, ra, RB(i));");
+        } break;
+
+        case OP_LOADK: {
+          int bx = GETARG_Bx(i);
+          TypeSet tk = ConstantType(f, bx);
+          if (bytecode_literals && (tk == T_INTEGER || tk == T_FLOAT)) {
+            char lit[64];
+            if (UnboxedDefinition(&ti, pc, pc + 1, GETARG_A(i)) >= 0)
+              PP_writeln(&pp, "(void) ra;");
+            PrintSetNumber(&ti, pc, GETARG_A(i), (tk == T_FLOAT),
+                           ConstantLiteral(f, bx, (tk == T_FLOAT), lit, sizeof(lit)));
+            break;
+          }
+          PP_writeln(&pp, "TValue *rb = k + GETARG_Bx(i);");
+          PP_writeln(&pp, "setobj2s(L, ra, rb);");
+          PrintReloadRange(&ti, pc, pc + 1, GETARG_A(i), GETARG_A(i));
+        } break;
+
+        case OP_LOADKX: {
+          assert(pc + 1 < nopcodes);
+          PP_writeln(&pp, "TValue *rb;");
+          if (lazy_savedpc) {
+            PP_writeln(&pp, "rb = k + GETARG_Ax(0x%08x);", code[pc+1]);
+          } else {
+            PP_writeln(&pp, "lua_assert(GET_OPCODE(*ci->u.l.savedpc) == OP_EXTRAARG);");
+            PP_writeln(&pp, "rb = k + GETARG_Ax(*ci->u.l.savedpc++);");
+          }
+          PP_writeln(&pp, "setobj2s(L, ra, rb);");
+          PrintReloadRange(&ti, pc, pc + 2, GETARG_A(i), GETARG_A(i));
+          PP_writeln(&pp, "goto label_%d;", pc+2);
+        } break;
+
+        case OP_LOADBOOL: {
+          PP_writeln(&pp, "setbvalue(ra, GETARG_B(i));");
+          if (GETARG_C(i)) { /* skip next instruction (if C) */
+            PrintSavedPcUpdate("ci->u.l.savedpc++;");
+            PP_writeln(&pp, "goto label_%d;", pc+2);
+          }
+        } break;
+
+        case OP_LOADNIL: {
+          PP_writeln(&pp, "int b = GETARG_B(i);");
+          PP_writeln(&pp, "do {");
+          PP_writeln(&pp, "  setnilvalue(ra++);");
+          PP_writeln(&pp, "} while (b--);");
+        } break;
+ 
+        case OP_GETUPVAL: {
+          PP_writeln(&pp, "int b = GETARG_B(i);");
+          PP_writeln(&pp, "setobj2s(L, ra, cl->upvals[b]->v);");
+        } break;
+     
+        case OP_GETTABUP: {
+          PP_writeln(&pp, "TValue *upval = cl->upvals[GETARG_B(i)]->v;");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          if (IsShortStringConstant(f, GETARG_C(i))) {
+            PP_writeln(&pp, "static unsigned int hint = 0;");
+            PP_writeln(&pp, "gettableCached(L, upval, rc, ra, &hint);");
+          } else {
+            PP_writeln(&pp, "gettableProtected(L, upval, rc, ra);");
+          }
+        } break;
+
+        case OP_GETTABLE: {
+          PP_writeln(&pp, "StkId rb = RB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          if (GuardedAccess(pc) >= 0) {
+            char key[64];
+            NumberOperand(&ti, pc, GETARG_C(i), T_INTEGER, 0, key, sizeof(key));
+            PP_writeln(&pp, "if (zz_likely(guard_%d)) {", GuardedAccess(pc));
+            PP_writeln(&pp, "  setobj2s(L, ra, &hvalue(rb)->array[%s - 1]);", key);
+            PP_writeln(&pp, "}");
+            PP_writeln(&pp, "else {");
+            PP_indent(&pp);
+            RegistersRead(f, pc, reads);
+            PrintSpills(&ti, pc, reads);
+            PP_writeln(&pp, "gettableInt(L, rb, rc, ra);");
+            PP_dedent(&pp);
+            PP_writeln(&pp, "}");
+          } else if (IsShortStringConstant(f, GETARG_C(i))) {
+            PP_writeln(&pp, "static unsigned int hint = 0;");
+            PP_writeln(&pp, "gettableCached(L, rb, rc, ra, &hint);");
+          } else if (RKType(&ti, types, GETARG_C(i)) & T_INTEGER)
+            PP_writeln(&pp, "gettableInt(L, rb, rc, ra);");
+          else
+            PP_writeln(&pp, "gettableProtected(L, rb, rc, ra);");
+        } break;
+
+        case OP_SETTABUP: {
+          PP_writeln(&pp, "(void) ra;");
+          PP_writeln(&pp, "TValue *upval = cl->upvals[GETARG_A(i)]->v;");
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          if (IsShortStringConstant(f, GETARG_B(i))) {
+            PP_writeln(&pp, "static unsigned int hint = 0;");
+            PP_writeln(&pp, "settableCached(L, upval, rb, rc, &hint);");
+          } else {
+            PP_writeln(&pp, "settableProtected(L, upval, rb, rc);");
+          }
+        } break;
+
+        case OP_SETUPVAL: {
+          PP_writeln(&pp, "UpVal *uv = cl->upvals[GETARG_B(i)];");
+          PP_writeln(&pp, "setobj(L, uv->v, ra);");
+          PP_writeln(&pp, "luaC_upvalbarrier(L, uv);");
+        } break;
+
+        case OP_SETTABLE: {
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          if (GuardedAccess(pc) >= 0) {
+            int c = GETARG_C(i);
+            int wc = (ISK(c) ? -1 : UnboxedRange(&ti, pc, c));
+            char key[64];
+            NumberOperand(&ti, pc, GETARG_B(i), T_INTEGER, 0, key, sizeof(key));
+            PP_writeln(&pp, "if (zz_likely(guard_%d)) {", GuardedAccess(pc));
+            PP_writeln(&pp, "  Table *h = hvalue(ra);");
+            if (wc >= 0) {
+              PP_writeln(&pp, "  set%svalue(&h->array[%s - 1], %s);",
+                         (ti.unboxed[wc] == T_INTEGER ? "i" : "flt"), key,
+                         UnboxedName(&ti, wc));
+            } else {
+              PP_writeln(&pp, "  setobj2t(L, &h->array[%s - 1], rc);", key);
+              PP_writeln(&pp, "  luaC_barrierback(L, h, rc);");
+            }
+            PP_writeln(&pp, "}");
+            PP_writeln(&pp, "else {");
+            PP_indent(&pp);
+            RegistersRead(f, pc, reads);
+            PrintSpills(&ti, pc, reads);
+            PP_writeln(&pp, "settableInt(L, ra, rb, rc);");
+            PP_dedent(&pp);
+            PP_writeln(&pp, "}");
+          } else if (IsShortStringConstant(f, GETARG_B(i))) {
+            PP_writeln(&pp, "static unsigned int hint = 0;");
+            PP_writeln(&pp, "settableCached(L, ra, rb, rc, &hint);");
+          } else if (RKType(&ti, types, GETARG_B(i)) & T_INTEGER)
+            PP_writeln(&pp, "settableInt(L, ra, rb, rc);");
+          else
+            PP_writeln(&pp, "settableProtected(L, ra, rb, rc);");
+        } break;
+
+        case OP_NEWTABLE: {
+          PP_writeln(&pp, "int b = GETARG_B(i);");
+          PP_writeln(&pp, "int c = GETARG_C(i);");
+          PP_writeln(&pp, "Table *t = luaH_new(L);");
+          PP_writeln(&pp, "sethvalue(L, ra, t);");
+          PP_writeln(&pp, "if (b != 0 || c != 0)");
+          PP_writeln(&pp, "  luaH_resize(L, t, luaO_fb2int(b), luaO_fb2int(c));");
+          PP_writeln(&pp, "checkGC(L, ra + 1);");
+        } break;
+
+        case OP_SELF: {
+          if (IsShortStringConstant(f, GETARG_C(i))) {
+            PP_writeln(&pp, "static unsigned int hints[2] = {0, 0};");
+            PP_writeln(&pp, "const TValue *aux;");
+            PP_writeln(&pp, "StkId rb = RB(i);");
+            PP_writeln(&pp, "TValue *rc = RKC(i);");
+            PP_writeln(&pp, "const TValue *m = zz_getmethod(L, rb, tsvalue(rc), hints, &aux);");
+            PP_writeln(&pp, "setobjs2s(L, ra + 1, rb);");
+            PP_writeln(&pp, "if (zz_likely(m != NULL)) {");
+            PP_writeln(&pp, "  setobj2s(L, ra, m);");
+            PP_writeln(&pp, "}");
+            PP_writeln(&pp, "else Protect(luaV_finishget(L, rb, rc, ra, aux));");
+            break;
+          }
+          PP_writeln(&pp, "const TValue *aux;");
+          PP_writeln(&pp, "StkId rb = RB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          PP_writeln(&pp, "TString *key = tsvalue(rc);  /* key must be a string */");
+          PP_writeln(&pp, "setobjs2s(L, ra + 1, rb);");
+          PP_writeln(&pp, "if (zz_likely(luaV_fastget(L, rb, key, aux, luaH_getstr))) {");
+          PP_writeln(&pp, "  setobj2s(L, ra, aux);");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else Protect(luaV_finishget(L, rb, rc, ra, aux));");
+        } break;
+
+        case OP_ADD: {
+          if (PrintTypedArith(&ti, pc)) break;
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
+          PP_writeln(&pp, "if (ttisinteger(rb) && ttisinteger(rc)) {");
+          PP_writeln(&pp, "  lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);");
+          PP_writeln(&pp, "  setivalue(ra, intop(+, ib, ic));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
+          PP_writeln(&pp, "  setfltvalue(ra, luai_numadd(L, nb, nc));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else { Protect(zz_trybinTM(L, rb, rc, ra, TM_ADD)); }");
+        } break;
+
+        case OP_SUB: {
+          if (PrintTypedArith(&ti, pc)) break;
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
+          PP_writeln(&pp, "if (ttisinteger(rb) && ttisinteger(rc)) {");
+          PP_writeln(&pp, "  lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);");
+          PP_writeln(&pp, "  setivalue(ra, intop(-, ib, ic));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
+          PP_writeln(&pp, "  setfltvalue(ra, luai_numsub(L, nb, nc));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else { Protect(zz_trybinTM(L, rb, rc, ra, TM_SUB)); }");
+        } break;
+
+        case OP_MUL: {
+          if (PrintTypedArith(&ti, pc)) break;
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
+          PP_writeln(&pp, "if (ttisinteger(rb) && ttisinteger(rc)) {");
+          PP_writeln(&pp, "  lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);");
+          PP_writeln(&pp, "  setivalue(ra, intop(*, ib, ic));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
+          PP_writeln(&pp, "  setfltvalue(ra, luai_nummul(L, nb, nc));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else { Protect(zz_trybinTM(L, rb, rc, ra, TM_MUL)); }");
+        } break;
+
+        case OP_DIV: {
+          if (PrintTypedArith(&ti, pc)) break;
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
+          PP_writeln(&pp, "if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
+          PP_writeln(&pp, "  setfltvalue(ra, luai_numdiv(L, nb, nc));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else { Protect(zz_trybinTM(L, rb, rc, ra, TM_DIV)); }");
+        } break;
+
+        case OP_BAND: {
+          if (PrintTypedArith(&ti, pc)) break;
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          PP_writeln(&pp, "lua_Integer ib; lua_Integer ic;");
+          PP_writeln(&pp, "if (tointeger(rb, &ib) && tointeger(rc, &ic)) {");
+          PP_writeln(&pp, "  setivalue(ra, intop(&, ib, ic));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else { Protect(zz_trybinTM(L, rb, rc, ra, TM_BAND)); }");
+        } break;
+
+        case OP_BOR: {
+          if (PrintTypedArith(&ti, pc)) break;
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          PP_writeln(&pp, "lua_Integer ib; lua_Integer ic;");
+          PP_writeln(&pp, "if (tointeger(rb, &ib) && tointeger(rc, &ic)) {");
+          PP_writeln(&pp, "  setivalue(ra, intop(|, ib, ic));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else { Protect(zz_trybinTM(L, rb, rc, ra, TM_BOR)); }");
+        } break;
+
+        case OP_BXOR: {
+          if (PrintTypedArith(&ti, pc)) break;
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          PP_writeln(&pp, "lua_Integer ib; lua_Integer ic;");
+          PP_writeln(&pp, "if (tointeger(rb, &ib) && tointeger(rc, &ic)) {");
+          PP_writeln(&pp, "  setivalue(ra, intop(^, ib, ic));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else { Protect(zz_trybinTM(L, rb, rc, ra, TM_BXOR)); }");
+        } break;
+
+        case OP_SHL: {
+          if (PrintTypedArith(&ti, pc)) break;
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          PP_writeln(&pp, "lua_Integer ib; lua_Integer ic;");
+          PP_writeln(&pp, "if (tointeger(rb, &ib) && tointeger(rc, &ic)) {");
+          PP_writeln(&pp, "  setivalue(ra, luaV_shiftl(ib, ic));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else { Protect(zz_trybinTM(L, rb, rc, ra, TM_SHL)); }");
+        } break;
+
+        case OP_SHR: {
+          if (PrintTypedArith(&ti, pc)) break;
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          PP_writeln(&pp, "lua_Integer ib; lua_Integer ic;");
+          PP_writeln(&pp, "if (tointeger(rb, &ib) && tointeger(rc, &ic)) {");
+          PP_writeln(&pp, "  setivalue(ra, luaV_shiftl(ib, -ic));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else { Protect(zz_trybinTM(L, rb, rc, ra, TM_SHR)); }");
+        } break;
+
+        case OP_MOD: {
+          if (PrintTypedArith(&ti, pc)) break;
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
+          PP_writeln(&pp, "if (ttisinteger(rb) && ttisinteger(rc)) {");
+          PP_writeln(&pp, "  lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);");
+          PP_writeln(&pp, "  setivalue(ra, luaV_mod(L, ib, ic));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
+          PP_writeln(&pp, "  lua_Number m;");
+          PP_writeln(&pp, "  luai_nummod(L, nb, nc, m);");
+          PP_writeln(&pp, "  setfltvalue(ra, m);");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else { Protect(zz_trybinTM(L, rb, rc, ra, TM_MOD)); }");
+        } break;
+
+        case OP_IDIV: { /* floor division */
+          if (PrintTypedArith(&ti, pc)) break;
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
+          PP_writeln(&pp, "if (ttisinteger(rb) && ttisinteger(rc)) {");
+          PP_writeln(&pp, "  lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);");
+          PP_writeln(&pp, "  setivalue(ra, luaV_div(L, ib, ic));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
+          PP_writeln(&pp, "  setfltvalue(ra, luai_numidiv(L, nb, nc));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else { Protect(zz_trybinTM(L, rb, rc, ra, TM_IDIV)); }");
+        } break;
+
+        case OP_POW: {
+          if (PrintTypedArith(&ti, pc)) break;
+          PP_writeln(&pp, "TValue *rb = RKB(i);");
+          PP_writeln(&pp, "TValue *rc = RKC(i);");
+          PP_writeln(&pp, "lua_Number nb; lua_Number nc;");
+          PP_writeln(&pp, "if (tonumber(rb, &nb) && tonumber(rc, &nc)) {");
+          PP_writeln(&pp, "  setfltvalue(ra, luai_numpow(L, nb, nc));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else { Protect(zz_trybinTM(L, rb, rc, ra, TM_POW)); }");
+        } break;
+
+        case OP_UNM: {
+          int b = GETARG_B(i);
+          if (types[b] == T_INTEGER || types[b] == T_FLOAT) {
+            char eb[64], expr[100];
+            int is_float = (types[b] == T_FLOAT);
+            NumberOperand(&ti, pc, b, types[b], is_float, eb, sizeof(eb));
+            if (is_float)
+              snprintf(expr, sizeof(expr), "luai_numunm(L, %s)", eb);
+            else
+              snprintf(expr, sizeof(expr), "intop(-, 0, %s)", eb);
+            PrintSetNumber(&ti, pc, GETARG_A(i), is_float, expr);
+            break;
+          }
+          PP_writeln(&pp, "TValue *rb = RB(i);");
+          PP_writeln(&pp, "lua_Number nb;");
+          PP_writeln(&pp, "if (ttisinteger(rb)) {");
+          PP_writeln(&pp, "  lua_Integer ib = ivalue(rb);");
+          PP_writeln(&pp, "  setivalue(ra, intop(-, 0, ib));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else if (tonumber(rb, &nb)) {");
+          PP_writeln(&pp, "  setfltvalue(ra, luai_numunm(L, nb));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else {");
+          PP_writeln(&pp, "  Protect(zz_trybinTM(L, rb, rb, ra, TM_UNM));");
+          PP_writeln(&pp, "}");
+        } break;
+
+        case OP_BNOT: {
+          int b = GETARG_B(i);
+          if (types[b] == T_INTEGER) {
+            char eb[64], expr[100];
+            NumberOperand(&ti, pc, b, T_INTEGER, 0, eb, sizeof(eb));
+            snprintf(expr, sizeof(expr), "intop(^, ~l_castS2U(0), %s)", eb);
+            PrintSetNumber(&ti, pc, GETARG_A(i), 0, expr);
+            break;
+          }
+          PP_writeln(&pp, "TValue *rb = RB(i);");
+          PP_writeln(&pp, "lua_Integer ib;");
+          PP_writeln(&pp, "if (tointeger(rb, &ib)) {");
+          PP_writeln(&pp, "  setivalue(ra, intop(^, ~l_castS2U(0), ib));");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else {");
+          PP_writeln(&pp, "  Protect(zz_trybinTM(L, rb, rb, ra, TM_BNOT));");
+          PP_writeln(&pp, "}");
+        } break;
+
+        case OP_NOT: {
+          PP_writeln(&pp, "TValue *rb = RB(i);");
+          PP_writeln(&pp, "int res = l_isfalse(rb);  /* next assignment may change this value */");
+          PP_writeln(&pp, "setbvalue(ra, res);");
+        } break;
+
+        case OP_LEN: {
+          PP_writeln(&pp, "Protect(luaV_objlen(L, ra, RB(i)));");
+        } break;
+
+        case OP_CONCAT: {
+          PP_writeln(&pp, "int b = GETARG_B(i);");
+          PP_writeln(&pp, "int c = GETARG_C(i);");
+          PP_writeln(&pp, "StkId rb;");
+          PP_writeln(&pp, "L->top = base + c + 1;  /* mark the end of concat operands */");
+          PP_writeln(&pp, "Protect(luaV_concat(L, c - b + 1));");
+          PP_writeln(&pp, "ra = RA(i);  /* 'luaV_concat' may invoke TMs and move the stack */");
+          PP_writeln(&pp, "rb = base + b;");
+          PP_writeln(&pp, "setobjs2s(L, ra, rb);");
+          PP_writeln(&pp, "checkGC(L, (ra >= rb ? ra + 1 : rb));");
+          PP_writeln(&pp, "L->top = ci->top;  /* restore top */");
+        } break;
+
+        case OP_JMP: {
+          int target = pc + GETARG_sBx(i) + 1;
+          PP_writeln(&pp, "(void) ra;");
+          PP_writeln(&pp, "int a = GETARG_A(i);");
+          PP_writeln(&pp, "if (a != 0) luaF_close(L, ci->u.l.base + a - 1);");
+          PrintSavedPcUpdate("ci->u.l.savedpc += GETARG_sBx(i);"); // (!)
+          PP_writeln(&pp, "goto label_%d;", target);
+        } break;
+
+        case OP_EQ:
+        case OP_LT:
+        case OP_LE: {
+          PP_writeln(&pp, "(void) ra;");
+          PrintComparison(&ti, pc);
+          PrintSkipJmp(pc, "cmp != GETARG_A(i)");
+          PP_indent(&pp);
+          PrintSavedPcUpdate("ci->u.l.savedpc++;");
+          PP_dedent(&pp);
+          PP_writeln(&pp, "  goto label_%d;", pc+2);
+          PP_writeln(&pp, "}");
+          PrintFusedJmp(&ti, pc, polls_hooks);
+        } break;
+
+        case OP_TEST: {
+          PrintSkipJmp(pc, "GETARG_C(i) ? l_isfalse(ra) : !l_isfalse(ra)");
+          PP_indent(&pp);
+          PrintSavedPcUpdate("ci->u.l.savedpc++;");
+          PP_dedent(&pp);
+          PP_writeln(&pp, "  goto label_%d;", pc+2);
+          PP_writeln(&pp, "}");
+          PrintFusedJmp(&ti, pc, polls_hooks);
+        } break;
+
+        case OP_TESTSET: {
+          PP_writeln(&pp, "TValue *rb = RB(i);");
+          PrintSkipJmp(pc, "GETARG_C(i) ? l_isfalse(rb) : !l_isfalse(rb)");
+          PP_indent(&pp);
+          PrintSavedPcUpdate("ci->u.l.savedpc++;");
+          PP_dedent(&pp);
+          PP_writeln(&pp, "  goto label_%d;", pc+2);
+          PP_writeln(&pp, "} else {");
+          PP_writeln(&pp, "  setobjs2s(L, ra, rb);");
+          PP_indent(&pp);
+          PrintReloadRange(&ti, pc, pc + 1, GETARG_A(i), GETARG_A(i));
+          PP_dedent(&pp);
+          PP_writeln(&pp, "}");
+          PrintFusedJmp(&ti, pc, polls_hooks);
+        } break;
+
+        case OP_CALL: {
+          PP_writeln(&pp, "ZZ_SPILL();");
+          PP_writeln(&pp, "int b = GETARG_B(i);");
+          PP_writeln(&pp, "int nresults = GETARG_C(i) - 1;");
+          PP_writeln(&pp, "if (b != 0) L->top = ra+b;  /* else previous instruction set top */");
+          const char *callee = NULL;
+          int target = PredictCallee(real, RealPc(pc), &callee);
+          if (target >= 0)
+            PP_writeln(&pp, "if (zz_precall_direct(L, ra, nresults, zz_magic_function_%d) ||  /* %s? */",
+                       target, callee);
+          else
+            PP_writeln(&pp, "if (zz_precall_magic(L, ra, nresults) ||  /* luaot function? */");
+          PP_writeln(&pp, "    luaD_precall(L, ra, nresults)) {  /* C function? */");
+          PP_writeln(&pp, "  if (nresults >= 0)");
+          PP_writeln(&pp, "    L->top = ci->top;  /* adjust results */");
+          PP_writeln(&pp, "  base = ci->u.l.base;  /* update 'base' */");
+          PP_writeln(&pp, "} else {  /* Lua function */");
+          PP_writeln(&pp, "  luaV_execute(L);");                       // (!)
+          PP_writeln(&pp, "  base = ci->u.l.base;  /* update 'base' */"); // (!)
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "ZZ_RELOAD();");
+        } break;
+
+        case OP_TAILCALL: {
+          PP_writeln(&pp, "ZZ_SPILL();");
+          PP_writeln(&pp, "int b = GETARG_B(i);");
+          PP_writeln(&pp, "if (b != 0) L->top = ra+b;  /* else previous instruction set top */");
+          PP_writeln(&pp, "lua_assert(GETARG_C(i) - 1 == LUA_MULTRET);");
+          PP_writeln(&pp, "if (zz_can_tailcall_magic(L, ra)) {  /* luaot function? */");
+          PP_writeln(&pp, "  /* move the callee down to our frame; luaD_runmagic calls it */");
+          PP_writeln(&pp, "  StkId func = ci->func;");
+          PP_writeln(&pp, "  int aux, n = cast_int(L->top - ra);");
+          PP_writeln(&pp, "  if (cl->p->sizep > 0) luaF_close(L, base);");
+          PP_writeln(&pp, "  for (aux = 0; aux < n; aux++)");
+          PP_writeln(&pp, "    setobjs2s(L, func + aux, ra + aux);");
+          PP_writeln(&pp, "  L->top = func + n;");
+          PP_writeln(&pp, "  return ZZ_MAGIC_TAILCALL;");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "if (luaD_precall(L, ra, LUA_MULTRET)) {  /* C function? */");
+          PP_writeln(&pp, "  base = ci->u.l.base;  /* update 'base' */");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else {");
+          PP_writeln(&pp, "  luaV_execute(L);");
+          PP_writeln(&pp, "  base = ci->u.l.base;  /* update 'base' */");
+          PP_writeln(&pp, "}");
+
+          // Tail calls to other luaot functions reuse our frame (see luaD_runmagic).
+          // C functions, interpreted Lua functions, and every call while there
+          // is a call hook, are ordinary calls instead, which leave their
+          // results at ra and L->top. That is only right because the parser
+          // always emits a "RETURN A 0" after a TAILCALL, which returns them.
+          // The asserts check that luaot can count on that instruction.
+          assert(pc+1 < nopcodes);
+          Instruction next = code[pc+1];
+          assert(GET_OPCODE(next) == OP_RETURN);
+          assert(GETARG_B(next) == 0);
+        } break;
+
+        case OP_RETURN: {
+          PP_writeln(&pp, "int b = GETARG_B(i);");
+          PP_writeln(&pp, "if (cl->p->sizep > 0) luaF_close(L, base);");
+          PP_writeln(&pp, "int ret = (b != 0 ? b - 1 : cast_int(L->top - ra));");
+          PP_writeln(&pp, "luaD_poscall(L, ci, ra, ret);");
+          PP_writeln(&pp, "return ret;");
+        } break;
+
+        case OP_FORLOOP: {
+          int target = pc + GETARG_sBx(i) + 1;
+          TypeSet tidx = types[GETARG_A(i)];
+          if (tidx == T_INTEGER || tidx == T_FLOAT) {
+            int a = GETARG_A(i);
+            int is_float = (tidx == T_FLOAT);
+            char eidx[64], elim[64], estep[64];
+            NumberOperand(&ti, pc, a, tidx, is_float, eidx, sizeof(eidx));
+            NumberOperand(&ti, pc, a+1, tidx, is_float, elim, sizeof(elim));
+            NumberOperand(&ti, pc, a+2, tidx, is_float, estep, sizeof(estep));
+            if (!is_float) {
+              PP_writeln(&pp, "lua_Integer step = %s;", estep);
+              PP_writeln(&pp, "lua_Integer idx = intop(+, %s, step); /* increment index */", eidx);
+              PP_writeln(&pp, "lua_Integer limit = %s;", elim);
+              PP_writeln(&pp, "if ((0 < step) ? (idx <= limit) : (limit <= idx)) {");
+            } else {
+              PP_writeln(&pp, "lua_Number step = %s;", estep);
+              PP_writeln(&pp, "lua_Number idx = luai_numadd(L, %s, step); /* inc. index */", eidx);
+              PP_writeln(&pp, "lua_Number limit = %s;", elim);
+              PP_writeln(&pp, "if (luai_numlt(0, step) ? luai_numle(idx, limit)");
+              PP_writeln(&pp, "                        : luai_numle(limit, idx)) {");
+            }
+            PP_indent(&pp);
+            if (UnboxedDefinition(&ti, pc, target, a) >= 0)
+              PrintSetRegister(&ti, pc, a, "ra", is_float, "idx");
+            else
+              PP_writeln(&pp, "chg%svalue(ra, idx);  /* update internal index... */", is_float ? "flt" : "i");
+            PrintSetRegister(&ti, pc, a+3, "ra + 3", is_float, "idx");  /* ...and external index */
+            PrintSavedPcUpdate("ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */");
+            PP_dedent(&pp);
+            PP_writeln(&pp, "  goto label_%d;  /* jump back */", target);
+            PP_writeln(&pp, "}");
+            if (LoopExit(pc) != pc + 1)
+              PP_writeln(&pp, "goto label_%d;  /* end of a copied loop */", LoopExit(pc));
+            break;
+          }
+          PP_writeln(&pp, "if (ttisinteger(ra)) {  /* integer loop? */");
+          PP_writeln(&pp, "  lua_Integer step = ivalue(ra + 2);");
+          PP_writeln(&pp, "  lua_Integer idx = intop(+, ivalue(ra), step); /* increment index */");
+          PP_writeln(&pp, "  lua_Integer limit = ivalue(ra + 1);");
+          PP_writeln(&pp, "  if ((0 < step) ? (idx <= limit) : (limit <= idx)) {");
+          PP_writeln(&pp, "    chgivalue(ra, idx);  /* update internal index... */");
+          PP_writeln(&pp, "    setivalue(ra + 3, idx);  /* ...and external index */");
+          PP_indent(&pp); PP_indent(&pp);
+          PrintSavedPcUpdate("ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */");
+          PP_dedent(&pp); PP_dedent(&pp);
+          PP_writeln(&pp, "    goto label_%d;  /* jump back */", target);
+          PP_writeln(&pp, "  }");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else {  /* floating loop */");
+          PP_writeln(&pp, "  lua_Number step = fltvalue(ra + 2);");
+          PP_writeln(&pp, "  lua_Number idx = luai_numadd(L, fltvalue(ra), step); /* inc. index */");
+          PP_writeln(&pp, "  lua_Number limit = fltvalue(ra + 1);");
+          PP_writeln(&pp, "  if (luai_numlt(0, step) ? luai_numle(idx, limit)");
+          PP_writeln(&pp, "                          : luai_numle(limit, idx)) {");
+          PP_writeln(&pp, "    chgfltvalue(ra, idx);  /* update internal index... */");
+          PP_writeln(&pp, "    setfltvalue(ra + 3, idx);  /* ...and external index */");
+          PP_indent(&pp); PP_indent(&pp);
+          PrintSavedPcUpdate("ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */");
+          PP_dedent(&pp); PP_dedent(&pp);
+          PP_writeln(&pp, "    goto label_%d;  /* jump back */", target);
+          PP_writeln(&pp, "  }");
+          PP_writeln(&pp, "}");
+          if (LoopExit(pc) != pc + 1)
+            PP_writeln(&pp, "goto label_%d;  /* end of a copied loop */", LoopExit(pc));
+        } break;
+
+        case OP_FORPREP: { 
+          int target = pc + GETARG_sBx(i) + 1;
+          int a = GETARG_A(i);
+          if (types[a] == T_INTEGER && types[a+2] == T_INTEGER &&
+              !(types[a+1] & T_OTHER)) {
+            /* luaV_forlimit cannot fail if the limit is a number */
+            PP_writeln(&pp, "TValue *init = ra;");
+            PP_writeln(&pp, "TValue *plimit = ra + 1;");
+            PP_writeln(&pp, "TValue *pstep = ra + 2;");
+            PP_writeln(&pp, "lua_Integer ilimit;");
+            PP_writeln(&pp, "int stopnow;");
+            PP_writeln(&pp, "luaV_forlimit(plimit, &ilimit, ivalue(pstep), &stopnow);");
+            PP_writeln(&pp, "lua_Integer initv = (stopnow ? 0 : ivalue(init));");
+            PP_writeln(&pp, "setivalue(plimit, ilimit);");
+            PP_writeln(&pp, "setivalue(init, intop(-, initv, ivalue(pstep)));");
+            if (IsGuardedLoop(f, pc))
+              PrintLoopGuard(&ti, pc);
+            PrintSavedPcUpdate("ci->u.l.savedpc += GETARG_sBx(i);");
+            PrintReloadRange(&ti, pc, target, a, a+2);
+            PP_writeln(&pp, "goto label_%d;", target);
+            break;
+          }
+          PP_writeln(&pp, "TValue *init = ra;");
+          PP_writeln(&pp, "TValue *plimit = ra + 1;");
+          PP_writeln(&pp, "TValue *pstep = ra + 2;");
+          PP_writeln(&pp, "lua_Integer ilimit;");
+          PP_writeln(&pp, "int stopnow;");
+          if (IsGuardedLoop(f, pc))
+            PP_writeln(&pp, "guard_%d = 0;", pc);
+          PP_writeln(&pp, "if (ttisinteger(init) && ttisinteger(pstep) &&");
+          PP_writeln(&pp, "    luaV_forlimit(plimit, &ilimit, ivalue(pstep), &stopnow)) {");
+          PP_writeln(&pp, "  /* all values are integer */");
+          PP_writeln(&pp, "  lua_Integer initv = (stopnow ? 0 : ivalue(init));");
+          PP_writeln(&pp, "  setivalue(plimit, ilimit);");
+          PP_writeln(&pp, "  setivalue(init, intop(-, initv, ivalue(pstep)));");
+          if (IsGuardedLoop(f, pc)) {
+            PP_indent(&pp);
+            PrintLoopGuard(&ti, pc);
+            PP_dedent(&pp);
+          }
+          if (FloatEntry(pc)) {
+            PP_indent(&pp);
+            PrintSavedPcUpdate("ci->u.l.savedpc += GETARG_sBx(i);");
+            PrintReloadRange(&ti, pc, target, a, a+2);
+            PP_writeln(&pp, "goto label_%d;  /* integer loop */", target);
+            PP_dedent(&pp);
+          }
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "else {  /* try making all values floats */");
+          PP_writeln(&pp, "  lua_Number ninit; lua_Number nlimit; lua_Number nstep;");
+          PP_writeln(&pp, "  if (!tonumber(plimit, &nlimit))");
+          PP_writeln(&pp, "    luaG_runerror(L, \"'for' limit must be a number\");");
+          PP_writeln(&pp, "  setfltvalue(plimit, nlimit);");
+          PP_writeln(&pp, "  if (!tonumber(pstep, &nstep))");
+          PP_writeln(&pp, "    luaG_runerror(L, \"'for' step must be a number\");");
+          PP_writeln(&pp, "  setfltvalue(pstep, nstep);");
+          PP_writeln(&pp, "  if (!tonumber(init, &ninit))");
+          PP_writeln(&pp, "    luaG_runerror(L, \"'for' initial value must be a number\");");
+          PP_writeln(&pp, "  setfltvalue(init, luai_numsub(L, ninit, nstep));");
+          if (FloatEntry(pc)) {
+            PP_indent(&pp);
+            PrintSavedPcUpdate("ci->u.l.savedpc += GETARG_sBx(i);");
+            PrintReloadRange(&ti, pc, FloatEntry(pc), a, a+2);
+            PP_writeln(&pp, "goto label_%d;  /* float loop */", FloatEntry(pc));
+            PP_dedent(&pp);
+            PP_writeln(&pp, "}");
+            break;
+          }
+          PP_writeln(&pp, "}");
+          PrintSavedPcUpdate("ci->u.l.savedpc += GETARG_sBx(i);");
+          PrintReloadRange(&ti, pc, target, a, a+2);
+          PP_writeln(&pp, "goto label_%d;", target);
+        } break;
+
+        case OP_TFORCALL: {
+          PP_writeln(&pp, "StkId cb = ra + 3;  /* call base */");
+          PP_writeln(&pp, "setobjs2s(L, cb+2, ra+2);");
+          PP_writeln(&pp, "setobjs2s(L, cb+1, ra+1);");
+          PP_writeln(&pp, "setobjs2s(L, cb, ra);");
+          PP_writeln(&pp, "L->top = cb + 3;  /* func. + 2 args (state and index) */");
+          PP_writeln(&pp, "Protect(luaD_call(L, cb, GETARG_C(i)));");
+          PP_writeln(&pp, "L->top = ci->top;");
+
+          assert(pc+1 < nopcodes);
+          assert(GET_OPCODE(code[pc+1]) == OP_TFORLOOP);
+        } break;
+
+        case OP_TFORLOOP: {
+          int target = pc + GETARG_sBx(i) + 1;
+          PP_writeln(&pp, "if (!ttisnil(ra + 1)) {  /* continue loop? */");
+          PP_writeln(&pp, "  setobjs2s(L, ra, ra + 1);  /* save control variable */");
+          PP_indent(&pp);
+          PrintSavedPcUpdate("ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */");
+          PP_dedent(&pp);
+          PP_writeln(&pp, "  goto label_%d; /* jump back */", target);
+          PP_writeln(&pp, "}");
+        } break;
+
+        case OP_SETLIST: {
+          assert(pc + 1 < nopcodes);
+          Instruction next_i = code[pc+1];
+
+          PP_writeln(&pp, "int n = GETARG_B(i);");
+          PP_writeln(&pp, "int c = GETARG_C(i);");
+          PP_writeln(&pp, "unsigned int last;");
+          PP_writeln(&pp, "Table *h;");
+          PP_writeln(&pp, "if (n == 0) n = cast_int(L->top - ra) - 1;");
+          PP_writeln(&pp, "if (c == 0) {");
+          if (lazy_savedpc) {
+            PP_writeln(&pp, "  c = GETARG_Ax(0x%08x);", next_i);
+          } else {
+            PP_writeln(&pp, "  lua_assert(GET_OPCODE(*ci->u.l.savedpc) == OP_EXTRAARG);", next_i);
+            PP_writeln(&pp, "  c = GETARG_Ax(*ci->u.l.savedpc++);", next_i); //(!)
+          }
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "h = hvalue(ra);");
+          PP_writeln(&pp, "last = ((c-1)*LFIELDS_PER_FLUSH) + n;");
+          PP_writeln(&pp, "if (last > h->sizearray)  /* needs more space? */");
+          PP_writeln(&pp, "  luaH_resizearray(L, h, last);  /* preallocate it at once */");
+          PP_writeln(&pp, "for (; n > 0; n--) {");
+          PP_writeln(&pp, "  TValue *val = ra+n;");
+          PP_writeln(&pp, "  luaH_setint(L, h, last--, val);");
+          PP_writeln(&pp, "  luaC_barrierback(L, h, val);");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "L->top = ci->top;  /* correct top (in case of previous open call) */");
+          if (GETARG_C(i) == 0) {
+            PP_writeln(&pp, "goto label_%d;  /* skip the OP_EXTRAARG */", pc+2);
+          }
+        } break;
+
+        case OP_CLOSURE: {
+          PP_writeln(&pp, "Proto *p = cl->p->p[GETARG_Bx(i)];");
+          PP_writeln(&pp, "LClosure *ncl = luaV_getcached(p, cl->upvals, base);  /* cached closure*/");
+          PP_writeln(&pp, "if (ncl == NULL)  /* no match? */");
+          PP_writeln(&pp, "  luaV_pushclosure(L, p, cl->upvals, base, ra);  /* create a new one */");
+          PP_writeln(&pp, "else");
+          PP_writeln(&pp, "  setclLvalue(L, ra, ncl);  /* push cashed closure */");
+          PP_writeln(&pp, "checkGC(L, ra + 1);");
+        } break;
+
+        case OP_VARARG: {
+          PP_writeln(&pp, "int b = GETARG_B(i) - 1;  /* required results */");
+          PP_writeln(&pp, "int j;");
+          PP_writeln(&pp, "int n = cast_int(base - ci->func) - cl->p->numparams - 1;");
+          PP_writeln(&pp, "if (n < 0)  /* less arguments than parameters? */");
+          PP_writeln(&pp, "  n = 0;  /* no vararg arguments */");
+          PP_writeln(&pp, "if (b < 0) {  /* B == 0? */");
+          PP_writeln(&pp, "  b = n;  /* get all var. arguments */");
+          PP_writeln(&pp, "  Protect(luaD_checkstack(L, n));");
+          PP_writeln(&pp, "  ra = RA(i);  /* previous call may change the stack */");
+          PP_writeln(&pp, "  L->top = ra + n;");
+          PP_writeln(&pp, "}");
+          PP_writeln(&pp, "for (j = 0; j < b && j < n; j++)");
+          PP_writeln(&pp, "  setobjs2s(L, ra + j, base - n + j);");
+          PP_writeln(&pp, "for (; j < b; j++)  /* complete required results with nil */");
+          PP_writeln(&pp, "  setnilvalue(ra + j);");
+        } break;
+
+        case OP_EXTRAARG: {
+          PP_writeln(&pp, "(void) ra;");
+          PP_writeln(&pp, "// NO OP");
+        } break;
+
+        default: {
+          fprintf(stderr, "Uninplemented opcode %s", luaP_opnames[o]);
+          fatal("aborting");
+        } break;
+      }
+
+      // The generic arithmetic code writes its result to the stack
+      if ((IsArith(o) || o == OP_UNM || o == OP_BNOT) && !ReadsUnboxed(&ti, pc)) {
+        PrintReloadRange(&ti, pc, pc+1, GETARG_A(i), GETARG_A(i));
+      }
+
+      PP_dedent(&pp); PP_writeln(&pp, "}");
+      PP_writeln(&pp, "");
+    }
+    if (nparts > 1)
+      PrintPartExits(&ti, live, start, end);
+    // Every path has returned by now, but the C compiler can't tell when the
+    // function ends in an infinite loop (whose OP_RETURN was unreachable).
+    PP_writeln(&pp, "return 0;  /* not reached */");
+    PP_dedent(&pp); PP_writeln(&pp, "}");
+    PP_writeln(&pp, "");
+  }
+
+  int spills = 0, reloads = 0;
+  for (int r = 0; r <= ti.nregs; r++) spills |= (spilled[r] >= 0);
+  for (int r = ti.nregs + 1; r <= 2 * ti.nregs; r++) reloads |= (spilled[r] >= 0);
+  if (spills) {
+    PP_writeln(&pp, "#undef ZZ_SPILL");
+    PP_writeln(&pp, "#define ZZ_SPILL() ((void)0)");
+  }
+  if (reloads) {
+    PP_writeln(&pp, "#undef ZZ_RELOAD");
+    PP_writeln(&pp, "#define ZZ_RELOAD() ((void)0)");
+  }
+  if (spills || reloads) PP_writeln(&pp, "");
+
+  free(reads);
+  free(spilled);
+  free(polls_hooks);
+  free(live);
+  free(is_label);
+  free(part_start);
+  free(is_entry);
+  FreeTypeInfo(&ti);
+  FreeGuardedLoops();
+  if (versioned) FreeVersionedLoops(&vf);
+}
+
+#define SS(x)	((x==1)?"":"s")
+#define S(x)	(int)(x),SS(x)
+
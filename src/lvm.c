@@ -740,8 +740,25 @@ void luaV_finishOp (lua_State *L) {
     if (a != 0) luaF_close(L, ci->u.l.base + a - 1); \
     ci->u.l.savedpc += GETARG_sBx(i) + e; }
 
+/*
+** Profiling for luaot (see lfunc.c). 'profilejump' must come before the
+** jump, while savedpc still points after the test or loop instruction.
+*/
+#if defined(LUAOT_PROFILE)
+#define profileop(ci) \
+  { if (cl->p->profile) luaF_profileop(cl->p, ci->u.l.savedpc - 1, base, k); }
+#define profilejump(ci,j) \
+  (cl->p->profile ? luaF_profilejump(cl->p, ci->u.l.savedpc - 1, j) : (void)0)
+#else
+#define profileop(ci)	((void)0)
+#define profilejump(ci,j)	((void)0)
+#endif
+
 /* for test instructions, execute the jump instruction that follows it */
-#define donextjump(ci)	{ i = *ci->u.l.savedpc; dojump(ci, i, 1); }
+#define donextjump(ci)	{ profilejump(ci, 1); i = *ci->u.l.savedpc; dojump(ci, i, 1); }
+
+/* for test instructions, skip the jump instruction that follows it */
+#define skipnextjump(ci)	(profilejump(ci, 0), ci->u.l.savedpc++)
 
 
 #define Protect(x)	{ {x;}; base = ci->u.l.base; }
@@ -757,6 +774,7 @@ void luaV_finishOp (lua_State *L) {
   i = *(ci->u.l.savedpc++); \
   if (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) \
     Protect(luaG_traceexec(L)); \
+  profileop(ci); \
   ra = RA(i); /* WARNING: any stack reallocation invalidates 'ra' */ \
   lua_assert(base == ci->u.l.base); \
   lua_assert(base <= L->top && L->top < L->stack + L->stacksize); \
@@ -1087,7 +1105,7 @@ void luaV_execute (lua_State *L) {
         TValue *rc = RKC(i);
         Protect(
           if (luaV_equalobj(L, rb, rc) != GETARG_A(i))
-            ci->u.l.savedpc++;
+            skipnextjump(ci);
           else
             donextjump(ci);
         )
@@ -1096,7 +1114,7 @@ void luaV_execute (lua_State *L) {
       vmcase(OP_LT) {
         Protect(
           if (luaV_lessthan(L, RKB(i), RKC(i)) != GETARG_A(i))
-            ci->u.l.savedpc++;
+            skipnextjump(ci);
           else
             donextjump(ci);
         )
@@ -1105,7 +1123,7 @@ void luaV_execute (lua_State *L) {
       vmcase(OP_LE) {
         Protect(
           if (luaV_lessequal(L, RKB(i), RKC(i)) != GETARG_A(i))
-            ci->u.l.savedpc++;
+            skipnextjump(ci);
           else
             donextjump(ci);
         )
@@ -1113,7 +1131,7 @@ void luaV_execute (lua_State *L) {
       }
       vmcase(OP_TEST) {
         if (GETARG_C(i) ? l_isfalse(ra) : !l_isfalse(ra))
-            ci->u.l.savedpc++;
+            skipnextjump(ci);
           else
           donextjump(ci);
         vmbreak;
@@ -1121,7 +1139,7 @@ void luaV_execute (lua_State *L) {
       vmcase(OP_TESTSET) {
         TValue *rb = RB(i);
         if (GETARG_C(i) ? l_isfalse(rb) : !l_isfalse(rb))
-          ci->u.l.savedpc++;
+          skipnextjump(ci);
         else {
           setobjs2s(L, ra, rb);
           donextjump(ci);
@@ -1194,6 +1212,7 @@ void luaV_execute (lua_State *L) {
           lua_Integer idx = intop(+, ivalue(ra), step); /* increment index */
           lua_Integer limit = ivalue(ra + 1);
           if ((0 < step) ? (idx <= limit) : (limit <= idx)) {
+            profilejump(ci, 1);
             ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
             chgivalue(ra, idx);  /* update internal index... */
             setivalue(ra + 3, idx);  /* ...and external index */
@@ -1205,6 +1224,7 @@ void luaV_execute (lua_State *L) {
           lua_Number limit = fltvalue(ra + 1);
           if (luai_numlt(0, step) ? luai_numle(idx, limit)
                                   : luai_numle(limit, idx)) {
+            profilejump(ci, 1);
             ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
             chgfltvalue(ra, idx);  /* update internal index... */
             setfltvalue(ra + 3, idx);  /* ...and external index */
@@ -1257,6 +1277,7 @@ void luaV_execute (lua_State *L) {
         l_tforloop:
         if (!ttisnil(ra + 1)) {  /* continue loop? */
           setobjs2s(L, ra, ra + 1);  /* save control variable */
+          profilejump(ci, 1);
            ci->u.l.savedpc += GETARG_sBx(i);  /* jump back */
         }
         vmbreak;